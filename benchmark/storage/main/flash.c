@@ -0,0 +1,144 @@
+/* Emulated flash with access statistics
+
+	All file systems access the partition through the partition API,
+	which is wrapped at link time, so SPIFFS mounted by the VFS is counted too.
+	The number of operations and the erase count of each sector are recorded,
+	and converted to the time it would take on SPI NOR flash.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "flash.h"
+
+static const char *TAG = "FLASH";
+
+static const esp_partition_t *s_partition;
+static uint32_t *s_erase_count;
+static FLASH_STAT_t s_stat;
+
+esp_err_t flash_init(const char *label)
+{
+	s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+	if (s_partition == NULL) {
+		ESP_LOGE(TAG, "Failed to find partition %s", label);
+		return ESP_ERR_NOT_FOUND;
+	}
+	s_erase_count = calloc(flash_sectors(), sizeof(uint32_t));
+	if (s_erase_count == NULL) return ESP_ERR_NO_MEM;
+	ESP_LOGI(TAG, "partition=%s size=%d sectors=%d", label, (int)s_partition->size, (int)flash_sectors());
+	return ESP_OK;
+}
+
+size_t flash_size(void)
+{
+	return s_partition->size;
+}
+
+size_t flash_sectors(void)
+{
+	return s_partition->size / FLASH_SECTOR_SIZE;
+}
+
+// Linked with --wrap, so every call to the partition API comes here
+esp_err_t __real_esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+esp_err_t __real_esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size);
+esp_err_t __real_esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+
+static bool is_counted(const esp_partition_t *partition)
+{
+	return s_partition && partition->address == s_partition->address;
+}
+
+esp_err_t __wrap_esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+	if (is_counted(partition)) {
+		s_stat.reads++;
+		s_stat.read_bytes += size;
+	}
+	return __real_esp_partition_read(partition, src_offset, dst, size);
+}
+
+esp_err_t __wrap_esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+	if (is_counted(partition)) {
+		s_stat.writes++;
+		s_stat.write_bytes += size;
+		// A page program never crosses a page boundary
+		s_stat.pages += (dst_offset + size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE - dst_offset / FLASH_PAGE_SIZE;
+	}
+	return __real_esp_partition_write(partition, dst_offset, src, size);
+}
+
+esp_err_t __wrap_esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+	if (is_counted(partition)) {
+		for (size_t sector = offset / FLASH_SECTOR_SIZE; sector < (offset + size) / FLASH_SECTOR_SIZE; sector++) {
+			s_erase_count[sector]++;
+			s_stat.erases++;
+		}
+	}
+	return __real_esp_partition_erase_range(partition, offset, size);
+}
+
+esp_err_t flash_read(size_t addr, void *dst, size_t size)
+{
+	return esp_partition_read(s_partition, addr, dst, size);
+}
+
+esp_err_t flash_write(size_t addr, const void *src, size_t size)
+{
+	return esp_partition_write(s_partition, addr, src, size);
+}
+
+esp_err_t flash_erase(size_t addr, size_t size)
+{
+	return esp_partition_erase_range(s_partition, addr, size);
+}
+
+// Erase the whole partition without counting it
+esp_err_t flash_reset(void)
+{
+	esp_err_t ret = esp_partition_erase_range(s_partition, 0, s_partition->size);
+	flash_clear();
+	return ret;
+}
+
+void flash_clear(void)
+{
+	memset(s_erase_count, 0, flash_sectors() * sizeof(uint32_t));
+	memset(&s_stat, 0, sizeof(s_stat));
+}
+
+void flash_stat(FLASH_STAT_t *stat)
+{
+	*stat = s_stat;
+}
+
+// Time in microseconds on SPI NOR flash for the operations between two snapshots
+int64_t flash_time(FLASH_STAT_t *before, FLASH_STAT_t *after)
+{
+	int64_t time = (int64_t)(after->erases - before->erases) * CONFIG_BENCH_ERASE_TIME;
+	time += (int64_t)(after->pages - before->pages) * CONFIG_BENCH_PROGRAM_TIME;
+	time += (int64_t)(after->read_bytes - before->read_bytes) * 1000000 / (CONFIG_BENCH_READ_SPEED * 1024);
+	return time;
+}
+
+void flash_wear(uint32_t *max, uint32_t *total)
+{
+	*max = 0;
+	*total = 0;
+	for (size_t sector = 0; sector < flash_sectors(); sector++) {
+		if (s_erase_count[sector] > *max) *max = s_erase_count[sector];
+		*total += s_erase_count[sector];
+	}
+}
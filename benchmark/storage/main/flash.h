@@ -0,0 +1,23 @@
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_PAGE_SIZE 256
+
+typedef struct {
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t erases;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t pages;
+} FLASH_STAT_t;
+
+esp_err_t flash_init(const char *label);
+size_t flash_size(void);
+size_t flash_sectors(void);
+esp_err_t flash_read(size_t addr, void *dst, size_t size);
+esp_err_t flash_write(size_t addr, const void *src, size_t size);
+esp_err_t flash_erase(size_t addr, size_t size);
+esp_err_t flash_reset(void);
+void flash_clear(void);
+void flash_stat(FLASH_STAT_t *stat);
+int64_t flash_time(FLASH_STAT_t *before, FLASH_STAT_t *after);
+void flash_wear(uint32_t *max, uint32_t *total);
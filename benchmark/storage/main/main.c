@@ -0,0 +1,391 @@
+/*
+	Storage benchmark for camera pictures on the linux target.
+
+	Replay the stat, unlink, write and stat sequence of the camera task
+	on SPIFFS, LittleFS and the raw archive layout.
+	The flash is emulated by a file, so the latency is calculated
+	from the flash operations of each step.
+	SPIFFS is mounted with the public VFS API, and its flash operations
+	are counted by flash.c that wraps the partition API.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_spiffs.h"
+
+#include "lfs.h"
+
+#include "flash.h"
+
+static const char *TAG = "BENCH";
+
+#define PICTURE_FILE "/picture.jpg"
+#define FILL_FILE_SIZE 65536
+#define WEAR_LIMIT 100000 // Erase cycles of SPI NOR flash
+#define MAX_FILES 8 // Same as mountSPIFFS
+
+enum { OP_STAT, OP_UNLINK, OP_WRITE, OP_VERIFY, OP_MAX };
+static const char *op_name[OP_MAX] = {"stat", "unlink", "write", "verify"};
+
+typedef struct {
+	const char *name;
+	esp_err_t (*mount)(void);
+	void (*unmount)(void);
+	int (*stat)(const char *path, size_t *size);
+	int (*unlink)(const char *path);
+	int (*write)(const char *path, const uint8_t *buf, size_t len);
+	int (*usage)(void); // Percentage of used space
+} BACKEND_t;
+
+/* SPIFFS through the VFS, as the camera uses it */
+
+#define SPIFFS_BASE_PATH "/spiffs"
+#define SPIFFS_LABEL "storage"
+
+static const char *spiffs_path(const char *path, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s%s", SPIFFS_BASE_PATH, path);
+	return buf;
+}
+
+static esp_err_t bench_spiffs_mount(void)
+{
+	// Same configuration as mountSPIFFS
+	esp_vfs_spiffs_conf_t conf = {
+		.base_path = SPIFFS_BASE_PATH,
+		.partition_label = SPIFFS_LABEL,
+		.max_files = MAX_FILES,
+		.format_if_mount_failed = true
+	};
+	esp_err_t ret = esp_vfs_spiffs_register(&conf);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "esp_vfs_spiffs_register fail %s", esp_err_to_name(ret));
+	}
+	return ret;
+}
+
+static void bench_spiffs_unmount(void)
+{
+	esp_vfs_spiffs_unregister(SPIFFS_LABEL);
+}
+
+static int bench_spiffs_stat(const char *path, size_t *size)
+{
+	char buf[64];
+	struct stat st;
+	if (stat(spiffs_path(path, buf, sizeof(buf)), &st) != 0) return -1;
+	*size = st.st_size;
+	return 0;
+}
+
+static int bench_spiffs_unlink(const char *path)
+{
+	char buf[64];
+	return unlink(spiffs_path(path, buf, sizeof(buf)));
+}
+
+static int bench_spiffs_write(const char *path, const uint8_t *buf, size_t len)
+{
+	char name[64];
+	FILE *f = fopen(spiffs_path(path, name, sizeof(name)), "wb");
+	if (f == NULL) return -1;
+	size_t written = fwrite(buf, 1, len, f);
+	if (fclose(f) != 0) return -1;
+	return written == len ? 0 : -1;
+}
+
+static int bench_spiffs_usage(void)
+{
+	size_t total, used;
+	if (esp_spiffs_info(SPIFFS_LABEL, &total, &used) != ESP_OK || total == 0) return 100;
+	return used * 100 / total;
+}
+
+/* LittleFS */
+
+static lfs_t s_lfs;
+static struct lfs_config s_lfs_config;
+
+static int littlefs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	return flash_read(block * c->block_size + off, buffer, size) == ESP_OK ? 0 : LFS_ERR_IO;
+}
+
+static int littlefs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	return flash_write(block * c->block_size + off, buffer, size) == ESP_OK ? 0 : LFS_ERR_IO;
+}
+
+static int littlefs_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	return flash_erase(block * c->block_size, c->block_size) == ESP_OK ? 0 : LFS_ERR_IO;
+}
+
+static int littlefs_sync(const struct lfs_config *c)
+{
+	return 0;
+}
+
+static esp_err_t bench_littlefs_mount(void)
+{
+	// Same configuration as the defaults of esp_littlefs
+	memset(&s_lfs_config, 0, sizeof(s_lfs_config));
+	s_lfs_config.read = littlefs_read;
+	s_lfs_config.prog = littlefs_prog;
+	s_lfs_config.erase = littlefs_erase;
+	s_lfs_config.sync = littlefs_sync;
+	s_lfs_config.read_size = 128;
+	s_lfs_config.prog_size = 128;
+	s_lfs_config.block_size = FLASH_SECTOR_SIZE;
+	s_lfs_config.block_count = flash_sectors();
+	s_lfs_config.block_cycles = 512;
+	s_lfs_config.cache_size = 512;
+	s_lfs_config.lookahead_size = 128;
+
+	int res = lfs_mount(&s_lfs, &s_lfs_config);
+	if (res != 0) {
+		lfs_format(&s_lfs, &s_lfs_config);
+		res = lfs_mount(&s_lfs, &s_lfs_config);
+	}
+	if (res != 0) {
+		ESP_LOGE(TAG, "lfs_mount fail %d", res);
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+static void bench_littlefs_unmount(void)
+{
+	lfs_unmount(&s_lfs);
+}
+
+static int bench_littlefs_stat(const char *path, size_t *size)
+{
+	struct lfs_info info;
+	if (lfs_stat(&s_lfs, path, &info) != 0) return -1;
+	*size = info.size;
+	return 0;
+}
+
+static int bench_littlefs_unlink(const char *path)
+{
+	return lfs_remove(&s_lfs, path) == 0 ? 0 : -1;
+}
+
+static int bench_littlefs_write(const char *path, const uint8_t *buf, size_t len)
+{
+	lfs_file_t file;
+	if (lfs_file_open(&s_lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) != 0) return -1;
+	lfs_ssize_t res = lfs_file_write(&s_lfs, &file, buf, len);
+	if (lfs_file_close(&s_lfs, &file) != 0) return -1;
+	return res == (lfs_ssize_t)len ? 0 : -1;
+}
+
+static int bench_littlefs_usage(void)
+{
+	lfs_ssize_t used = lfs_fs_size(&s_lfs);
+	if (used < 0) return 100;
+	return used * 100 / s_lfs_config.block_count;
+}
+
+/* Raw partition with the layout of archive.c */
+
+#define RAW_HEADER_SIZE 32
+
+static uint32_t s_raw_sector;
+static size_t s_raw_size;
+
+static uint32_t raw_sectors_of(size_t len)
+{
+	return (RAW_HEADER_SIZE + len + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+}
+
+static esp_err_t bench_raw_mount(void)
+{
+	s_raw_sector = 0;
+	s_raw_size = 0;
+	return ESP_OK;
+}
+
+static void bench_raw_unmount(void)
+{
+}
+
+// Read the header of the last picture
+static int bench_raw_stat(const char *path, size_t *size)
+{
+	if (s_raw_size == 0) return -1;
+	uint8_t header[RAW_HEADER_SIZE];
+	uint32_t sector = s_raw_sector - raw_sectors_of(s_raw_size);
+	if (flash_read(sector * FLASH_SECTOR_SIZE, header, sizeof(header)) != ESP_OK) return -1;
+	*size = s_raw_size;
+	return 0;
+}
+
+// Old pictures are overwritten by the next write
+static int bench_raw_unlink(const char *path)
+{
+	return 0;
+}
+
+static int bench_raw_write(const char *path, const uint8_t *buf, size_t len)
+{
+	uint32_t span = raw_sectors_of(len);
+	if (s_raw_sector + span > flash_sectors()) s_raw_sector = 0;
+	size_t offset = s_raw_sector * FLASH_SECTOR_SIZE;
+	if (flash_erase(offset, span * FLASH_SECTOR_SIZE) != ESP_OK) return -1;
+	if (flash_write(offset + RAW_HEADER_SIZE, buf, len) != ESP_OK) return -1;
+	uint8_t header[RAW_HEADER_SIZE];
+	memset(header, 0xff, sizeof(header));
+	memcpy(header, &len, sizeof(uint32_t));
+	if (flash_write(offset, header, sizeof(header)) != ESP_OK) return -1;
+	s_raw_sector += span;
+	s_raw_size = len;
+	return 0;
+}
+
+static int bench_raw_usage(void)
+{
+	return 0;
+}
+
+static BACKEND_t backends[] = {
+	{"SPIFFS", bench_spiffs_mount, bench_spiffs_unmount, bench_spiffs_stat, bench_spiffs_unlink, bench_spiffs_write, bench_spiffs_usage},
+	{"LittleFS", bench_littlefs_mount, bench_littlefs_unmount, bench_littlefs_stat, bench_littlefs_unlink, bench_littlefs_write, bench_littlefs_usage},
+	{"Raw", bench_raw_mount, bench_raw_unmount, bench_raw_stat, bench_raw_unlink, bench_raw_write, bench_raw_usage},
+};
+
+// Percentage of space used by other files before the pictures are written
+static int fill_levels[] = {0, 50, 75};
+
+/* Benchmark */
+
+static uint32_t s_random = 2463534242;
+
+static uint32_t xorshift32(void)
+{
+	s_random ^= s_random << 13;
+	s_random ^= s_random >> 17;
+	s_random ^= s_random << 5;
+	return s_random;
+}
+
+static int compare_time(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int64_t percentile(int64_t *time, int count, int p)
+{
+	if (count == 0) return 0;
+	int64_t *sorted = malloc(count * sizeof(int64_t));
+	memcpy(sorted, time, count * sizeof(int64_t));
+	qsort(sorted, count, sizeof(int64_t), compare_time);
+	int64_t ret = sorted[(count - 1) * p / 100];
+	free(sorted);
+	return ret;
+}
+
+static void fill(BACKEND_t *backend, int level, uint8_t *buf)
+{
+	char path[32];
+	for (int i=0; backend->usage() < level; i++) {
+		sprintf(path, "/fill%03d.bin", i);
+		if (backend->write(path, buf, FILL_FILE_SIZE) != 0) {
+			backend->unlink(path);
+			break;
+		}
+	}
+	ESP_LOGI(TAG, "%s filled %d%%", backend->name, backend->usage());
+}
+
+static void run(BACKEND_t *backend, int level, uint8_t *buf, int64_t *time[OP_MAX])
+{
+	if (flash_reset() != ESP_OK || backend->mount() != ESP_OK) return;
+	if (level) fill(backend, level, buf);
+	// Only the pictures are counted
+	flash_clear();
+
+	int cycles = CONFIG_BENCH_CYCLES;
+	int failures = 0;
+	uint64_t payload = 0;
+	for (int i=0; i<cycles; i++) {
+		size_t len = CONFIG_BENCH_FRAME_MIN + xorshift32() % (CONFIG_BENCH_FRAME_MAX - CONFIG_BENCH_FRAME_MIN + 1);
+		size_t size = 0;
+		FLASH_STAT_t before, after;
+		// Same sequence as camera_task
+		for (int op=0; op<OP_MAX; op++) {
+			flash_stat(&before);
+			int res = 0;
+			if (op == OP_STAT) backend->stat(PICTURE_FILE, &size);
+			if (op == OP_UNLINK) backend->unlink(PICTURE_FILE);
+			if (op == OP_WRITE) res = backend->write(PICTURE_FILE, buf, len);
+			if (op == OP_VERIFY) res = backend->stat(PICTURE_FILE, &size) || size != len;
+			flash_stat(&after);
+			time[op][i] = flash_time(&before, &after);
+			if (res != 0) failures++;
+		}
+		payload += len;
+	}
+
+	FLASH_STAT_t stat;
+	flash_stat(&stat);
+	uint32_t wear_max, wear_total;
+	flash_wear(&wear_max, &wear_total);
+	backend->unmount();
+
+	for (int op=0; op<OP_MAX; op++) {
+		ESP_LOGI(TAG, "%s fill=%d%% %s p50=%"PRIi64"us p99=%"PRIi64"us max=%"PRIi64"us",
+			backend->name, level, op_name[op], percentile(time[op], cycles, 50), percentile(time[op], cycles, 99), percentile(time[op], cycles, 100));
+	}
+	// The latency of write as the pictures are overwritten
+	int window = cycles / 10;
+	ESP_LOGI(TAG, "%s fill=%d%% write p99 first %d=%"PRIi64"us last %d=%"PRIi64"us failures=%d",
+		backend->name, level, window, percentile(time[OP_WRITE], window, 99),
+		window, percentile(time[OP_WRITE] + cycles - window, window, 99), failures);
+	uint64_t pictures = wear_max ? (uint64_t)WEAR_LIMIT * cycles / wear_max : 0;
+	ESP_LOGI(TAG, "%s fill=%d%% erases/picture=%.2f max erases/sector=%"PRIu32" write amplification=%.2f pictures to wear out=%"PRIu64,
+		backend->name, level, (double)stat.erases / cycles, wear_max,
+		(double)stat.write_bytes / payload, pictures);
+}
+
+void app_main(void)
+{
+	ESP_ERROR_CHECK(flash_init("storage"));
+	ESP_LOGI(TAG, "cycles=%d picture=%d-%d bytes erase=%dus program=%dus read=%dKB/s",
+		CONFIG_BENCH_CYCLES, CONFIG_BENCH_FRAME_MIN, CONFIG_BENCH_FRAME_MAX,
+		CONFIG_BENCH_ERASE_TIME, CONFIG_BENCH_PROGRAM_TIME, CONFIG_BENCH_READ_SPEED);
+
+	// The contents of JPEG are close to random
+	uint8_t *buf = malloc(CONFIG_BENCH_FRAME_MAX > FILL_FILE_SIZE ? CONFIG_BENCH_FRAME_MAX : FILL_FILE_SIZE);
+	for (int i=0; i<CONFIG_BENCH_FRAME_MAX || i<FILL_FILE_SIZE; i++) buf[i] = xorshift32();
+	int64_t *time[OP_MAX];
+	for (int op=0; op<OP_MAX; op++) time[op] = malloc(CONFIG_BENCH_CYCLES * sizeof(int64_t));
+
+	for (int i=0; i<sizeof(backends)/sizeof(backends[0]); i++) {
+		for (int j=0; j<sizeof(fill_levels)/sizeof(fill_levels[0]); j++) {
+			// The raw partition has no other files
+			if (backends[i].mount == bench_raw_mount && fill_levels[j]) continue;
+			run(&backends[i], fill_levels[j], buf, time);
+		}
+	}
+
+	for (int op=0; op<OP_MAX; op++) free(time[op]);
+	free(buf);
+	fflush(stdout);
+	exit(0);
+}
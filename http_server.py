@@ -0,0 +1,42 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+#
+# Receive the picture posted by the HTTP sink
+#
+import argparse
+import http.server
+import os
+import time
+
+class Handler(http.server.BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1' # Keep the connection alive
+
+	def do_POST(self):
+		start = time.time()
+		length = int(self.headers.get('Content-Length', 0))
+		body = self.rfile.read(length)
+		name = os.path.basename(self.headers.get('X-Camera-Name', 'picture.jpg')) or 'picture.jpg'
+		path = os.path.join(self.server.output, name)
+		with open(path, 'wb') as f:
+			f.write(body)
+		print("{} bytes trigger={} source={} size={} from {} in {:.1f}ms -> {}".format(len(body),
+			self.headers.get('X-Camera-Trigger'), self.headers.get('X-Camera-Source'),
+			self.headers.get('X-Camera-Size'), self.client_address[0], (time.time() - start) * 1000, path))
+		self.send_response(200)
+		self.send_header('Content-Length', '0')
+		self.end_headers()
+
+	def log_message(self, format, *args):
+		pass
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--port', type=int, help='http port', default=8080)
+	parser.add_argument('--output', help='directory of the received pictures', default=".")
+	args = parser.parse_args()
+	print("args.port={}".format(args.port))
+	print("args.output={}".format(args.output))
+
+	server = http.server.ThreadingHTTPServer(('', args.port), Handler)
+	server.output = args.output
+	server.serve_forever()
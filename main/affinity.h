@@ -0,0 +1,10 @@
+// Core on which each stage runs
+#if CONFIG_TASK_PINNING
+#define CAPTURE_CORE CONFIG_CAPTURE_CORE
+#define ENCODER_CORE CONFIG_ENCODER_CORE
+#define NETWORK_CORE CONFIG_NETWORK_CORE
+#else
+#define CAPTURE_CORE tskNO_AFFINITY
+#define ENCODER_CORE tskNO_AFFINITY
+#define NETWORK_CORE tskNO_AFFINITY
+#endif
@@ -0,0 +1,261 @@
+/* Circular image archive on raw flash partition
+
+	Each picture is written at the start of a sector with a 32 bytes header.
+	The header is the index entry of the picture.
+	Pictures are appended sequentially, and the oldest pictures are erased when the partition wraps.
+	The index in RAM is rebuilt by reading the header at each sector at startup.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+
+#include "archive.h"
+
+static const char *TAG = "ARCHIVE";
+
+#define ARCHIVE_MAGIC 0x41524348 // ARCH
+#define SECTOR_SIZE 4096
+#define MAX_FRAMES CONFIG_ARCHIVE_MAX_FRAMES
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t size;
+	uint32_t timestamp;
+	uint16_t width;
+	uint16_t height;
+	uint8_t state;
+	uint8_t reserved[11];
+} ARCHIVE_HEADER_t;
+
+typedef struct {
+	uint32_t seq;
+	uint32_t sector;
+	uint32_t size;
+	uint32_t timestamp;
+	uint8_t state;
+} ARCHIVE_ENTRY_t;
+
+static const esp_partition_t *s_partition;
+static SemaphoreHandle_t s_mutex;
+static uint32_t s_sectors;
+static uint32_t s_write_sector;
+static uint32_t s_next_seq;
+
+// Index ordered from oldest to newest
+static ARCHIVE_ENTRY_t s_index[MAX_FRAMES];
+static int s_count;
+
+// Statistics of write
+static uint32_t s_writes;
+static uint64_t s_write_bytes;
+static int64_t s_write_time;
+static int64_t s_write_max;
+
+static uint32_t sectors_of(uint32_t size)
+{
+	return (sizeof(ARCHIVE_HEADER_t) + size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+static void index_remove(int i)
+{
+	memmove(&s_index[i], &s_index[i+1], sizeof(ARCHIVE_ENTRY_t) * (s_count - i - 1));
+	s_count--;
+}
+
+static void index_append(ARCHIVE_ENTRY_t *entry)
+{
+	if (s_count == MAX_FRAMES) index_remove(0);
+	s_index[s_count++] = *entry;
+}
+
+static ARCHIVE_ENTRY_t *index_find(uint32_t seq)
+{
+	for (int i=0; i<s_count; i++) {
+		if (s_index[i].seq == seq) return &s_index[i];
+	}
+	return NULL;
+}
+
+esp_err_t archive_init(void)
+{
+	s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "archive");
+	if (s_partition == NULL) {
+		ESP_LOGE(TAG, "Failed to find archive partition");
+		return ESP_ERR_NOT_FOUND;
+	}
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	s_sectors = s_partition->size / SECTOR_SIZE;
+	s_count = 0;
+	s_write_sector = 0;
+	s_next_seq = 1;
+
+	// Rebuild the index from the headers
+	int64_t start = esp_timer_get_time();
+	ARCHIVE_ENTRY_t found[MAX_FRAMES];
+	int found_count = 0;
+	for (uint32_t sector=0; sector<s_sectors; ) {
+		ARCHIVE_HEADER_t header;
+		esp_err_t ret = esp_partition_read(s_partition, sector * SECTOR_SIZE, &header, sizeof(header));
+		if (ret != ESP_OK) return ret;
+		uint32_t span = sectors_of(header.size);
+		if (header.magic != ARCHIVE_MAGIC || sector + span > s_sectors) {
+			sector++;
+			continue;
+		}
+		ARCHIVE_ENTRY_t entry = {
+			.seq = header.seq,
+			.sector = sector,
+			.size = header.size,
+			.timestamp = header.timestamp,
+			.state = header.state,
+		};
+		// Keep the newest MAX_FRAMES pictures ordered by sequence number
+		int pos = found_count;
+		while (pos > 0 && found[pos-1].seq > entry.seq) pos--;
+		if (found_count < MAX_FRAMES) {
+			memmove(&found[pos+1], &found[pos], sizeof(ARCHIVE_ENTRY_t) * (found_count - pos));
+			found[pos] = entry;
+			found_count++;
+		} else if (pos > 0) {
+			memmove(&found[0], &found[1], sizeof(ARCHIVE_ENTRY_t) * (pos - 1));
+			found[pos-1] = entry;
+		}
+		sector += span;
+	}
+	for (int i=0; i<found_count; i++) index_append(&found[i]);
+
+	if (s_count) {
+		ARCHIVE_ENTRY_t *last = &s_index[s_count-1];
+		s_write_sector = last->sector + sectors_of(last->size);
+		s_next_seq = last->seq + 1;
+	}
+	ESP_LOGI(TAG, "partition size=%"PRIu32" sectors=%"PRIu32" pictures=%d next_seq=%"PRIu32" write_sector=%"PRIu32" scan=%"PRIi64"us",
+		s_partition->size, s_sectors, s_count, s_next_seq, s_write_sector, esp_timer_get_time() - start);
+	return ESP_OK;
+}
+
+esp_err_t archive_write(const uint8_t *buf, size_t len, int width, int height, time_t timestamp, uint32_t *seq)
+{
+	if (s_partition == NULL) return ESP_ERR_INVALID_STATE;
+	uint32_t span = sectors_of(len);
+	if (span > s_sectors) {
+		ESP_LOGE(TAG, "picture too large %d", (int)len);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	int64_t start = esp_timer_get_time();
+	if (s_write_sector + span > s_sectors) s_write_sector = 0;
+
+	// Forget the pictures to be overwritten
+	for (int i=0; i<s_count; ) {
+		uint32_t first = s_index[i].sector;
+		uint32_t last = first + sectors_of(s_index[i].size);
+		if (first < s_write_sector + span && s_write_sector < last) {
+			ESP_LOGD(TAG, "evict seq=%"PRIu32, s_index[i].seq);
+			index_remove(i);
+		} else {
+			i++;
+		}
+	}
+
+	size_t offset = s_write_sector * SECTOR_SIZE;
+	esp_err_t ret = esp_partition_erase_range(s_partition, offset, span * SECTOR_SIZE);
+	if (ret == ESP_OK) {
+		// Write the picture before the header, so that a header is never valid without its picture
+		ret = esp_partition_write(s_partition, offset + sizeof(ARCHIVE_HEADER_t), buf, len);
+	}
+	ARCHIVE_HEADER_t header;
+	memset(&header, 0xff, sizeof(header));
+	header.magic = ARCHIVE_MAGIC;
+	header.seq = s_next_seq;
+	header.size = len;
+	header.timestamp = timestamp;
+	header.width = width;
+	header.height = height;
+	header.state = ARCHIVE_STATE_PENDING;
+	if (ret == ESP_OK) {
+		ret = esp_partition_write(s_partition, offset, &header, sizeof(header));
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to write archive (%s)", esp_err_to_name(ret));
+		xSemaphoreGive(s_mutex);
+		return ret;
+	}
+
+	ARCHIVE_ENTRY_t entry = {
+		.seq = header.seq,
+		.sector = s_write_sector,
+		.size = header.size,
+		.timestamp = header.timestamp,
+		.state = header.state,
+	};
+	index_append(&entry);
+	*seq = s_next_seq++;
+	s_write_sector += span;
+
+	int64_t elapsed = esp_timer_get_time() - start;
+	s_writes++;
+	s_write_bytes += len;
+	s_write_time += elapsed;
+	if (elapsed > s_write_max) s_write_max = elapsed;
+	ESP_LOGI(TAG, "seq=%"PRIu32" sector=%"PRIu32" size=%d elapsed=%"PRIi64"us max=%"PRIi64"us throughput=%"PRIi64"KB/s",
+		*seq, entry.sector, (int)len, elapsed, s_write_max, (int64_t)(s_write_bytes * 1000000 / s_write_time) / 1024);
+	xSemaphoreGive(s_mutex);
+	return ESP_OK;
+}
+
+esp_err_t archive_read(uint32_t seq, size_t offset, uint8_t *buf, size_t len)
+{
+	if (s_partition == NULL) return ESP_ERR_INVALID_STATE;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	ARCHIVE_ENTRY_t *entry = index_find(seq);
+	esp_err_t ret = ESP_ERR_NOT_FOUND;
+	if (entry && offset + len <= entry->size) {
+		ret = esp_partition_read(s_partition, entry->sector * SECTOR_SIZE + sizeof(ARCHIVE_HEADER_t) + offset, buf, len);
+	}
+	xSemaphoreGive(s_mutex);
+	return ret;
+}
+
+esp_err_t archive_set_state(uint32_t seq, uint8_t state)
+{
+	if (s_partition == NULL) return ESP_ERR_INVALID_STATE;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	ARCHIVE_ENTRY_t *entry = index_find(seq);
+	esp_err_t ret = ESP_ERR_NOT_FOUND;
+	if (entry) {
+		// Clearing bits of NOR flash does not need erase
+		entry->state &= state;
+		ret = esp_partition_write(s_partition, entry->sector * SECTOR_SIZE + offsetof(ARCHIVE_HEADER_t, state),
+			&entry->state, sizeof(entry->state));
+	}
+	xSemaphoreGive(s_mutex);
+	return ret;
+}
+
+void archive_dump(void)
+{
+	if (s_partition == NULL) return;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i=0; i<s_count; i++) {
+		ESP_LOGI(TAG, "seq=%"PRIu32" sector=%"PRIu32" size=%"PRIu32" timestamp=%"PRIu32" state=0x%02x",
+			s_index[i].seq, s_index[i].sector, s_index[i].size, s_index[i].timestamp, s_index[i].state);
+	}
+	xSemaphoreGive(s_mutex);
+}
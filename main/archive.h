@@ -0,0 +1,12 @@
+// Delivery state of archived picture.
+// Bits are only cleared, so the state is updated in place without erasing flash.
+#define ARCHIVE_STATE_PENDING 0xFF
+#define ARCHIVE_STATE_SENT 0xFE
+#define ARCHIVE_STATE_FAILED 0xFD
+#define ARCHIVE_STATE_SUPPRESSED 0xFB // Near-duplicate picture that is not sent
+
+esp_err_t archive_init(void);
+esp_err_t archive_write(const uint8_t *buf, size_t len, int width, int height, time_t timestamp, uint32_t *seq);
+esp_err_t archive_read(uint32_t seq, size_t offset, uint8_t *buf, size_t len);
+esp_err_t archive_set_state(uint32_t seq, uint8_t state);
+void archive_dump(void);
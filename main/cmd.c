@@ -0,0 +1,157 @@
+/* Shutter command
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_camera.h"
+
+#include "cmd.h"
+
+static const char *TAG = "CMD";
+
+ESP_EVENT_DEFINE_BASE(CAMERA_EVENT);
+
+static const struct {
+	const char *name;
+	framesize_t framesize;
+} framesize_names[] = {
+	{"QVGA", FRAMESIZE_QVGA},
+	{"CIF", FRAMESIZE_CIF},
+	{"HVGA", FRAMESIZE_HVGA},
+	{"VGA", FRAMESIZE_VGA},
+	{"SVGA", FRAMESIZE_SVGA},
+	{"XGA", FRAMESIZE_XGA},
+	{"HD", FRAMESIZE_HD},
+	{"SXGA", FRAMESIZE_SXGA},
+	{"UXGA", FRAMESIZE_UXGA},
+};
+
+void cmd_init(CMD_t *cmd, uint16_t command, SOURCE source)
+{
+	cmd->command = command;
+	cmd->taskHandle = xTaskGetCurrentTaskHandle();
+	cmd->source = source;
+	cmd->timestamp = 0;
+	cmd->id = 0;
+	cmd->direct = false;
+	cmd->burst = false;
+	cmd->to[0] = 0;
+	cmd->framesize = PARAM_DEFAULT;
+	cmd->quality = PARAM_DEFAULT;
+	cmd->flash = PARAM_DEFAULT;
+}
+
+// VGA or 640x480
+static int parse_framesize(const char *value)
+{
+	for (int i=0; i<sizeof(framesize_names)/sizeof(framesize_names[0]); i++) {
+		if (strcasecmp(value, framesize_names[i].name) == 0) return framesize_names[i].framesize;
+	}
+	int width, height;
+	if (sscanf(value, "%dx%d", &width, &height) == 2) {
+		for (int i=0; i<=FRAMESIZE_UXGA; i++) {
+			if (resolution[i].width == width && resolution[i].height == height) return i;
+		}
+	}
+	return -1;
+}
+
+// a@example.com,b@example.com
+static bool valid_recipients(const char *value)
+{
+	if (strlen(value) == 0 || strlen(value) >= RECIPIENTS_SIZE) return false;
+	// Only the characters of the address, so the SMTP command can not be injected
+	for (const char *p = value; *p; p++) {
+		if (isalnum((unsigned char)*p)) continue;
+		if (strchr("@.-_+,", *p) == NULL) return false;
+	}
+	return true;
+}
+
+/*
+ * Parse the capture parameters from a text like this.
+ * framesize=VGA quality=10 flash=on to=a@example.com,b@example.com
+ * Words without '=' are ignored, so "take picture" is a valid command.
+ * Returns the number of parameters set, or -1 if a parameter is invalid.
+ */
+int cmd_parse_params(char *text, CMD_t *cmd)
+{
+	int params = 0;
+	char *save;
+	for (char *token = strtok_r(text, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+		char *value = strchr(token, '=');
+		if (value == NULL) continue;
+		*value++ = 0;
+		ESP_LOGD(TAG, "key=[%s] value=[%s]", token, value);
+		if (strcasecmp(token, "framesize") == 0) {
+			int framesize = parse_framesize(value);
+			if (framesize < 0) {
+				ESP_LOGW(TAG, "Unknown framesize [%s]", value);
+				return -1;
+			}
+			cmd->framesize = framesize;
+		} else if (strcasecmp(token, "quality") == 0) {
+			int quality = atoi(value);
+			if (quality < 0 || quality > 63) {
+				ESP_LOGW(TAG, "quality out of range [%s]", value);
+				return -1;
+			}
+			cmd->quality = quality;
+		} else if (strcasecmp(token, "flash") == 0) {
+			if (strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0) {
+				cmd->flash = 1;
+			} else if (strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+				cmd->flash = 0;
+			} else {
+				ESP_LOGW(TAG, "Invalid flash [%s]", value);
+				return -1;
+			}
+		} else if (strcasecmp(token, "to") == 0) {
+			// The TCP, UDP text and console shutters are not authenticated,
+			// so they can not mail the picture to anyone else
+			if (cmd->source != SOURCE_MQTT) {
+				ESP_LOGW(TAG, "Recipients are accepted only from MQTT");
+				return -1;
+			}
+			if (valid_recipients(value) == false) {
+				ESP_LOGW(TAG, "Invalid recipients [%s]", value);
+				return -1;
+			}
+			strcpy(cmd->to, value);
+		} else {
+			ESP_LOGW(TAG, "Unknown parameter [%s]", token);
+			return -1;
+		}
+		params++;
+	}
+	return params;
+}
+
+// Post the event to the default event loop
+void cmd_post_event(CAMERA_EVENT_ID event, uint32_t id, uint8_t source, int64_t timestamp)
+{
+	if (id == 0) return;
+	CAMERA_EVENT_t data = {
+		.id = id,
+		.source = source,
+		.elapsed = esp_timer_get_time() - timestamp,
+	};
+	esp_err_t ret = esp_event_post(CAMERA_EVENT, event, &data, sizeof(data), 0);
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "esp_event_post fail %s", esp_err_to_name(ret));
+	}
+}
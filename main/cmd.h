@@ -1,8 +1,28 @@
+#include <time.h>
+#include "esp_event_base.h"
+
 typedef enum {CMD_TAKE, CMD_SMTP, CMD_HALT} COMMAND;
 
+#define RECIPIENTS_SIZE 96
+
+// Source of trigger
+typedef enum {SOURCE_KEYBOARD, SOURCE_GPIO, SOURCE_TCP, SOURCE_UDP, SOURCE_MQTT, SOURCE_MAX} SOURCE;
+
+// Capture parameter not specified. The configured value is used.
+#define PARAM_DEFAULT 0xff
+
 typedef struct {
 	uint16_t command;
 	TaskHandle_t taskHandle;
+	uint8_t framesize; // framesize_t or PARAM_DEFAULT
+	uint8_t quality; // 0-63 or PARAM_DEFAULT
+	uint8_t flash; // 0:OFF 1:ON or PARAM_DEFAULT
+	uint8_t source; // SOURCE
+	int64_t timestamp; // esp_timer_get_time() of the trigger. 0 when the aggregator stamps it
+	uint32_t id; // Assigned by the aggregator
+	bool direct; // The shutter receives the frame buffer directly
+	bool burst; // One of the pictures of a burst. Never merged into another trigger
+	char to[RECIPIENTS_SIZE]; // Comma separated recipients. Empty for the configured recipient
 } CMD_t;
 
 typedef struct {
@@ -11,4 +31,36 @@ typedef struct {
 	char localFileName[64];
 	size_t localFileSize;
 	char remoteFileName[64];
+	char thumbFileName[64]; // Empty when there is no thumbnail
+	size_t thumbFileSize;
+	time_t captureTime; // Local time. 0 when the time is unknown
+	int width;
+	int height;
+	int quality;
+	uint32_t archiveSeq; // Sequence number in archive
+	uint32_t triggerId;
+	uint8_t source;
+	int64_t triggerTime;
+	char to[RECIPIENTS_SIZE]; // Empty for the configured recipient
 } SMTP_t;
+
+// Events of the picture taken for a trigger
+ESP_EVENT_DECLARE_BASE(CAMERA_EVENT);
+
+typedef enum {
+	CAMERA_EVENT_CAPTURED,
+	CAMERA_EVENT_SENT, // Email delivered
+	CAMERA_EVENT_FAILED, // Email not delivered
+	CAMERA_EVENT_SUPPRESSED, // Near-duplicate picture not sent
+	CAMERA_EVENT_CANCELLED, // Trigger cancelled before capture
+} CAMERA_EVENT_ID;
+
+typedef struct {
+	uint32_t id; // Trigger id
+	uint8_t source;
+	int64_t elapsed; // Time from the trigger in microseconds
+} CAMERA_EVENT_t;
+
+void cmd_init(CMD_t *cmd, uint16_t command, SOURCE source);
+int cmd_parse_params(char *text, CMD_t *cmd);
+void cmd_post_event(CAMERA_EVENT_ID event, uint32_t id, uint8_t source, int64_t timestamp);
@@ -0,0 +1,278 @@
+/* mDNS host name, service advertisement and resolution cache
+
+	mDNS is initialized only here.
+	The camera is advertised as _smtpcam._tcp, so all cameras are found with one query.
+	  avahi-browse -rt _smtpcam._tcp
+	Resolved .local hosts are cached, and refreshed in the background before they expire.
+	mdns_query_a does not return the TTL of the record, so the configured TTL is used.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
+#include "mdns.h"
+
+#include "affinity.h"
+#include "discovery.h"
+
+static const char *TAG = "DISCOVERY";
+
+#define CACHE_SIZE 4
+#define CACHE_TTL ((int64_t)CONFIG_MDNS_CACHE_TTL * 1000000)
+#define QUERY_TIMEOUT CONFIG_MDNS_QUERY_TIMEOUT
+
+typedef struct {
+	char host[64]; // Without .local
+	char ip[16];
+	int64_t expires;
+	int64_t used;
+	uint32_t hits;
+	uint32_t queries;
+	bool valid;
+} CACHE_t;
+
+static CACHE_t s_cache[CACHE_SIZE];
+static SemaphoreHandle_t s_mutex;
+static TaskHandle_t s_refresh_task;
+static bool s_initialized = false;
+
+#if CONFIG_FRAMESIZE_VGA
+#define RESOLUTION "640x480"
+#elif CONFIG_FRAMESIZE_SVGA
+#define RESOLUTION "800x600"
+#elif CONFIG_FRAMESIZE_XGA
+#define RESOLUTION "1024x768"
+#elif CONFIG_FRAMESIZE_HD
+#define RESOLUTION "1280x720"
+#elif CONFIG_FRAMESIZE_SXGA
+#define RESOLUTION "1280x1024"
+#elif CONFIG_FRAMESIZE_UXGA
+#define RESOLUTION "1600x1200"
+#endif
+
+static esp_err_t query(const char *host, char *ip)
+{
+	esp_ip4_addr_t addr;
+	addr.addr = 0;
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = mdns_query_a(host, QUERY_TIMEOUT, &addr);
+	if (err != ESP_OK) {
+		if (err == ESP_ERR_NOT_FOUND) {
+			ESP_LOGW(TAG, "%s.local was not found", host);
+		} else {
+			ESP_LOGE(TAG, "Query Failed: %s", esp_err_to_name(err));
+		}
+		return ESP_FAIL;
+	}
+	sprintf(ip, IPSTR, IP2STR(&addr));
+	ESP_LOGI(TAG, "%s.local resolved to %s in %"PRIi64"us", host, ip, esp_timer_get_time() - start);
+	return ESP_OK;
+}
+
+// Call with s_mutex taken
+static CACHE_t *cache_find(const char *host)
+{
+	for (int i=0; i<CACHE_SIZE; i++) {
+		if (s_cache[i].valid && strcmp(s_cache[i].host, host) == 0) return &s_cache[i];
+	}
+	return NULL;
+}
+
+// Call with s_mutex taken
+static void cache_store(const char *host, const char *ip)
+{
+	CACHE_t *entry = cache_find(host);
+	if (entry == NULL) {
+		// Replace the least recently used entry
+		entry = &s_cache[0];
+		for (int i=0; i<CACHE_SIZE; i++) {
+			if (s_cache[i].valid == false) {
+				entry = &s_cache[i];
+				break;
+			}
+			if (s_cache[i].used < entry->used) entry = &s_cache[i];
+		}
+		memset(entry, 0, sizeof(CACHE_t));
+		strlcpy(entry->host, host, sizeof(entry->host));
+		entry->used = esp_timer_get_time();
+		entry->valid = true;
+	}
+	strcpy(entry->ip, ip);
+	entry->expires = esp_timer_get_time() + CACHE_TTL;
+	entry->queries++;
+}
+
+// Query the entries used recently again, before they expire
+static void refresh_task(void *pvParameters)
+{
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_MDNS_CACHE_TTL * 1000 / 4));
+		for (int i=0; i<CACHE_SIZE; i++) {
+			char host[64];
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			int64_t now = esp_timer_get_time();
+			bool refresh = s_cache[i].valid && s_cache[i].expires - now < CACHE_TTL / 4;
+			// The entry not used for a while is left to expire
+			if (s_cache[i].valid && now - s_cache[i].used > CACHE_TTL * 2) {
+				ESP_LOGI(TAG, "Forget %s.local", s_cache[i].host);
+				s_cache[i].valid = false;
+				refresh = false;
+			}
+			strcpy(host, s_cache[i].host);
+			xSemaphoreGive(s_mutex);
+			if (refresh == false) continue;
+
+			char ip[16];
+			if (query(host, ip) != ESP_OK) continue;
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			cache_store(host, ip);
+			xSemaphoreGive(s_mutex);
+		}
+	}
+}
+
+static void advertise(void)
+{
+	const esp_app_desc_t *app = esp_app_get_description();
+	char shutters[48] = "";
+#if CONFIG_SHUTTER_ENTER
+	strcat(shutters, "enter,");
+#endif
+#if CONFIG_SHUTTER_GPIO
+	strcat(shutters, "gpio,");
+#endif
+#if CONFIG_SHUTTER_TCP
+	strcat(shutters, "tcp,");
+#endif
+#if CONFIG_SHUTTER_UDP
+	strcat(shutters, "udp,");
+#endif
+#if CONFIG_SHUTTER_MQTT
+	strcat(shutters, "mqtt,");
+#endif
+	if (strlen(shutters)) shutters[strlen(shutters) - 1] = 0;
+	char tcp_port[8] = "";
+	char udp_port[8] = "";
+#if CONFIG_SHUTTER_TCP
+	sprintf(tcp_port, "%d", CONFIG_TCP_PORT);
+#endif
+#if CONFIG_SHUTTER_UDP
+	sprintf(udp_port, "%d", CONFIG_UDP_PORT);
+#endif
+
+	mdns_txt_item_t txt[] = {
+		{"res", RESOLUTION},
+		{"fw", app->version},
+		{"idf", app->idf_ver},
+		{"shutter", shutters},
+#if CONFIG_SHUTTER_TCP
+		{"tcp", tcp_port},
+#endif
+#if CONFIG_SHUTTER_UDP
+		{"udp", udp_port},
+#endif
+#if CONFIG_SHUTTER_MQTT
+		{"mqtt", CONFIG_MQTT_SUB_TOPIC},
+#endif
+	};
+	// The port of the service is the TCP control port, or 0 when there is none
+	uint16_t port = 0;
+#if CONFIG_SHUTTER_TCP
+	port = CONFIG_TCP_PORT;
+#endif
+	esp_err_t err = mdns_service_add(CONFIG_MDNS_HOSTNAME, "_smtpcam", "_tcp", port, txt, sizeof(txt) / sizeof(txt[0]));
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "mdns_service_add failed: %s", esp_err_to_name(err));
+		return;
+	}
+	ESP_LOGI(TAG, "Advertise _smtpcam._tcp port=%d res=%s fw=%s shutter=%s", port, RESOLUTION, app->version, shutters);
+}
+
+esp_err_t discovery_init(void)
+{
+	if (s_initialized) return ESP_OK;
+	//initialize mDNS
+	esp_err_t err = mdns_init();
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "mdns_init failed: %s", esp_err_to_name(err));
+		return err;
+	}
+	//set mDNS hostname (required if you want to advertise services)
+	ESP_ERROR_CHECK( mdns_hostname_set(CONFIG_MDNS_HOSTNAME) );
+	ESP_ERROR_CHECK( mdns_instance_name_set(CONFIG_MDNS_HOSTNAME) );
+	ESP_LOGI(TAG, "mdns hostname set to: [%s]", CONFIG_MDNS_HOSTNAME);
+	advertise();
+
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	xTaskCreatePinnedToCore(refresh_task, "MDNS", 1024*3, NULL, 1, &s_refresh_task, NETWORK_CORE);
+	s_initialized = true;
+	return ESP_OK;
+}
+
+/*
+ * Resolve the host name to the IP address.
+ * The name without .local is copied as it is.
+ * The cached address is returned even when it has expired, and the background task queries it again.
+ */
+esp_err_t discovery_resolve(const char *host, char *ip, size_t len)
+{
+	const char *local = strstr(host, ".local");
+	if (local == NULL || s_initialized == false) {
+		strlcpy(ip, host, len);
+		return ESP_OK;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "%.*s", (int)(local - host), host);
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	CACHE_t *entry = cache_find(name);
+	if (entry) {
+		entry->used = esp_timer_get_time();
+		entry->hits++;
+		strlcpy(ip, entry->ip, len);
+		bool expired = entry->expires < entry->used;
+		xSemaphoreGive(s_mutex);
+		ESP_LOGI(TAG, "%s resolved to %s from cache%s", host, ip, expired ? " (expired)" : "");
+		if (expired) xTaskNotifyGive(s_refresh_task);
+		return ESP_OK;
+	}
+	xSemaphoreGive(s_mutex);
+
+	char address[16];
+	if (query(name, address) != ESP_OK) {
+		// The caller may use the name as it is
+		strlcpy(ip, host, len);
+		return ESP_FAIL;
+	}
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	cache_store(name, address);
+	xSemaphoreGive(s_mutex);
+	strlcpy(ip, address, len);
+	return ESP_OK;
+}
+
+void discovery_dump(void)
+{
+	if (s_initialized == false) return;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	int64_t now = esp_timer_get_time();
+	for (int i=0; i<CACHE_SIZE; i++) {
+		if (s_cache[i].valid == false) continue;
+		ESP_LOGI(TAG, "%s.local=%s expires in %"PRIi64"s hits=%"PRIu32" queries=%"PRIu32,
+			s_cache[i].host, s_cache[i].ip, (s_cache[i].expires - now) / 1000000, s_cache[i].hits, s_cache[i].queries);
+	}
+	xSemaphoreGive(s_mutex);
+}
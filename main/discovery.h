@@ -0,0 +1,3 @@
+esp_err_t discovery_init(void);
+esp_err_t discovery_resolve(const char *host, char *ip, size_t len);
+void discovery_dump(void);
@@ -0,0 +1,164 @@
+/* EXIF APP1 segment
+
+	Build an APP1 segment that is inserted right after the SOI marker of the JPEG.
+	Only the metadata is built here. The JPEG itself is never decoded.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+
+static const char *TAG = "EXIF";
+
+#define TYPE_ASCII 2
+#define TYPE_LONG 4
+#define TYPE_UNDEFINED 7
+
+typedef struct {
+	uint16_t tag;
+	uint16_t type;
+	uint32_t count; // Number of bytes for ASCII and UNDEFINED
+	const void *value;
+} exif_entry_t;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static size_t value_size(const exif_entry_t *e)
+{
+	return (e->type == TYPE_LONG) ? e->count * 4 : e->count;
+}
+
+// Size of IFD including the values that do not fit in the entry
+static size_t ifd_size(const exif_entry_t *e, int n)
+{
+	size_t size = 2 + 12 * n + 4;
+	for (int i=0; i<n; i++) {
+		size_t vs = value_size(&e[i]);
+		if (vs > 4) size += (vs + 1) & ~1;
+	}
+	return size;
+}
+
+// Write IFD at offset of TIFF header. Entries must be sorted by tag.
+static size_t ifd_write(uint8_t *tiff, size_t offset, const exif_entry_t *e, int n)
+{
+	uint8_t *p = tiff + offset;
+	size_t data = offset + 2 + 12 * n + 4;
+	put16(p, n);
+	p += 2;
+	for (int i=0; i<n; i++) {
+		size_t vs = value_size(&e[i]);
+		put16(p, e[i].tag);
+		put16(p+2, e[i].type);
+		put32(p+4, e[i].count);
+		memset(p+8, 0, 4);
+		uint8_t *v = p+8;
+		if (vs > 4) {
+			put32(p+8, data);
+			v = tiff + data;
+			data += (vs + 1) & ~1;
+		}
+		if (e[i].type == TYPE_LONG) {
+			for (int j=0; j<e[i].count; j++) put32(v + j * 4, ((const uint32_t *)e[i].value)[j]);
+		} else {
+			memcpy(v, e[i].value, vs);
+		}
+		p += 12;
+	}
+	put32(p, 0); // No next IFD
+	return data;
+}
+
+/*
+ * Build the APP1 segment.
+ * captureTime is the local time of capture, or 0 when the time is unknown.
+ * Returns the length of segment, or 0 if buf is too small.
+ */
+size_t exif_build(uint8_t *buf, size_t size, time_t captureTime, int width, int height, int quality)
+{
+	char description[32];
+	snprintf(description, sizeof(description), "%dx%d quality=%d", width, height, quality);
+	char datetime[20];
+	if (captureTime) {
+		struct tm timeinfo;
+		gmtime_r(&captureTime, &timeinfo);
+		strftime(datetime, sizeof(datetime), "%Y:%m:%d %H:%M:%S", &timeinfo);
+	}
+	uint8_t mac[6];
+	char serial[13] = "";
+	if (esp_read_mac(mac, ESP_MAC_WIFI_STA) == ESP_OK) {
+		sprintf(serial, "%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
+	}
+	uint32_t dimension[2] = {width, height};
+	uint32_t exif_offset = 0;
+
+	exif_entry_t ifd0[] = {
+		{0x010E, TYPE_ASCII, strlen(description)+1, description}, // ImageDescription
+		{0x010F, TYPE_ASCII, sizeof("Espressif"), "Espressif"}, // Make
+		{0x0110, TYPE_ASCII, sizeof(CONFIG_IDF_TARGET), CONFIG_IDF_TARGET}, // Model
+		{0x0132, TYPE_ASCII, sizeof(datetime), datetime}, // DateTime
+		{0x8769, TYPE_LONG, 1, &exif_offset}, // ExifIFDPointer
+	};
+	exif_entry_t exif[] = {
+		{0x9000, TYPE_UNDEFINED, 4, "0230"}, // ExifVersion
+		{0x9003, TYPE_ASCII, sizeof(datetime), datetime}, // DateTimeOriginal
+		{0xA002, TYPE_LONG, 1, &dimension[0]}, // PixelXDimension
+		{0xA003, TYPE_LONG, 1, &dimension[1]}, // PixelYDimension
+		{0xA430, TYPE_ASCII, sizeof(CONFIG_MDNS_HOSTNAME), CONFIG_MDNS_HOSTNAME}, // CameraOwnerName
+		{0xA431, TYPE_ASCII, strlen(serial)+1, serial}, // BodySerialNumber
+	};
+	int ifd0_num = sizeof(ifd0) / sizeof(ifd0[0]);
+	int exif_num = sizeof(exif) / sizeof(exif[0]);
+	if (captureTime == 0) {
+		// Remove DateTime and DateTimeOriginal
+		ifd0[3] = ifd0[4];
+		ifd0_num--;
+		memmove(&exif[1], &exif[2], sizeof(exif_entry_t) * (exif_num - 2));
+		exif_num--;
+	}
+
+	// TIFF header is 8 bytes, followed by IFD0 and Exif IFD
+	exif_offset = 8 + ifd_size(ifd0, ifd0_num);
+	size_t tiff_len = exif_offset + ifd_size(exif, exif_num);
+	size_t app1_len = 2 + 2 + 6 + tiff_len;
+	if (app1_len > size || app1_len - 2 > 0xffff) {
+		ESP_LOGE(TAG, "buffer too small. required=%d", (int)app1_len);
+		return 0;
+	}
+
+	memset(buf, 0, app1_len);
+	buf[0] = 0xFF;
+	buf[1] = 0xE1;
+	buf[2] = (app1_len - 2) >> 8; // Big endian, including length itself
+	buf[3] = (app1_len - 2) & 0xff;
+	memcpy(buf+4, "Exif\0\0", 6);
+	uint8_t *tiff = buf + 10;
+	tiff[0] = 'I';
+	tiff[1] = 'I';
+	put16(tiff+2, 0x002A);
+	put32(tiff+4, 8);
+	ifd_write(tiff, 8, ifd0, ifd0_num);
+	ifd_write(tiff, exif_offset, exif, exif_num);
+	ESP_LOGD(TAG, "app1_len=%d", (int)app1_len);
+	return app1_len;
+}
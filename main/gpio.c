@@ -1,28 +1,66 @@
 /* The example of GPIO Input
+ *
+ * The edges of the button are detected by the interrupt.
+ * The time of the first edge is taken in the ISR,
+ * and the level is read again when the hardware timer expires after the last bounce.
  *
  * This sample code is in the public domain.
  */
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "driver/gptimer.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "cmd.h"
-
-extern QueueHandle_t xQueueCmd;
+#include "trigger.h"
+#if CONFIG_DEEP_SLEEP
+#include "power.h"
+#endif
 
 static const char *TAG = "GPIO";
 
+static QueueHandle_t xQueueGpio;
+static gptimer_handle_t s_timer;
+static volatile bool s_bouncing;
+static volatile int64_t s_edge_time;
+static int s_stable_level;
+static int s_fire_level;
+
+static void IRAM_ATTR gpio_isr_handler(void *arg)
+{
+	// Restart the debounce time at every edge
+	gptimer_set_raw_count(s_timer, 0);
+	if (s_bouncing == false) {
+		s_edge_time = esp_timer_get_time();
+		s_bouncing = true;
+		gptimer_start(s_timer);
+	}
+}
+
+static bool IRAM_ATTR debounce_handler(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+	gptimer_stop(timer);
+	s_bouncing = false;
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	int level = gpio_get_level(CONFIG_GPIO_INPUT);
+	if (level != s_stable_level) {
+		s_stable_level = level;
+		if (level == s_fire_level) {
+			int64_t timestamp = s_edge_time;
+			xQueueSendFromISR(xQueueGpio, &timestamp, &xHigherPriorityTaskWoken);
+		}
+	}
+	return xHigherPriorityTaskWoken == pdTRUE;
+}
+
 void gpio(void *pvParameter)
 {
 	ESP_LOGI(TAG, "Start CONFIG_GPIO_INPUT=%d", CONFIG_GPIO_INPUT);
 	CMD_t cmdBuf;
-	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
-
-	// set the GPIO as a input
-	gpio_reset_pin(CONFIG_GPIO_INPUT);
-	gpio_set_direction(CONFIG_GPIO_INPUT, GPIO_MODE_DEF_INPUT);
+	cmd_init(&cmdBuf, CMD_TAKE, SOURCE_GPIO);
 
 #if CONFIG_GPIO_PULLUP
 	ESP_LOGI(TAG, "GPIO%d is PULL UP", CONFIG_GPIO_INPUT);
@@ -35,22 +73,78 @@ void gpio(void *pvParameter)
 	int release = 0;
 #endif
 	ESP_LOGI(TAG, "push=%d release=%d", push, release);
+#if CONFIG_GPIO_FIRE_ON_PRESS
+	s_fire_level = push;
+	const char *fire = "Push Button";
+#else
+	s_fire_level = release;
+	const char *fire = "Release Button";
+#endif
+	s_stable_level = release;
+	s_bouncing = false;
 
-	while(1) {
-		int level = gpio_get_level(CONFIG_GPIO_INPUT);
-		if (level == push) {
-			ESP_LOGI(TAG, "Push Button");
-			while(1) {
-				level = gpio_get_level(CONFIG_GPIO_INPUT);
-				if (level == release) break;
-				vTaskDelay(1);
-			}
-			ESP_LOGI(TAG, "Release Button");
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
-			}
+	xQueueGpio = xQueueCreate(4, sizeof(int64_t));
+	configASSERT( xQueueGpio );
+
+	// Hardware timer for debounce
+	gptimer_config_t timer_config = {
+		.clk_src = GPTIMER_CLK_SRC_DEFAULT,
+		.direction = GPTIMER_COUNT_UP,
+		.resolution_hz = 1000000, // 1MHz, 1 tick=1us
+	};
+	ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &s_timer));
+	gptimer_event_callbacks_t cbs = {
+		.on_alarm = debounce_handler,
+	};
+	ESP_ERROR_CHECK(gptimer_register_event_callbacks(s_timer, &cbs, NULL));
+	gptimer_alarm_config_t alarm_config = {
+		.alarm_count = CONFIG_GPIO_DEBOUNCE_TIME * 1000,
+	};
+	ESP_ERROR_CHECK(gptimer_set_alarm_action(s_timer, &alarm_config));
+	ESP_ERROR_CHECK(gptimer_enable(s_timer));
+
+	// set the GPIO as a input with interrupt on both edges
+	gpio_reset_pin(CONFIG_GPIO_INPUT);
+	gpio_config_t io_conf = {
+		.pin_bit_mask = 1ULL << CONFIG_GPIO_INPUT,
+		.mode = GPIO_MODE_INPUT,
+#if CONFIG_GPIO_PULLUP
+		.pull_up_en = GPIO_PULLUP_ENABLE,
+		.pull_down_en = GPIO_PULLDOWN_DISABLE,
+#else
+		.pull_up_en = GPIO_PULLUP_DISABLE,
+		.pull_down_en = GPIO_PULLDOWN_ENABLE,
+#endif
+		.intr_type = GPIO_INTR_ANYEDGE,
+	};
+	ESP_ERROR_CHECK(gpio_config(&io_conf));
+	esp_err_t ret = gpio_install_isr_service(0);
+	// Another driver may have installed the service
+	if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(ret);
+	ESP_ERROR_CHECK(gpio_isr_handler_add(CONFIG_GPIO_INPUT, gpio_isr_handler, NULL));
+	ESP_LOGI(TAG, "Fire on %s debounce=%dms", fire, CONFIG_GPIO_DEBOUNCE_TIME);
+
+#if CONFIG_DEEP_SLEEP
+	// The edge that woke the chip was not seen by the interrupt
+	if (power_woken_by_shutter()) {
+		if (s_fire_level == release && gpio_get_level(CONFIG_GPIO_INPUT) == push) {
+			// The picture is taken when the button is released
+			s_stable_level = push;
+		} else {
+			ESP_LOGI(TAG, "Woken by %s", fire);
+			// The latency from the wake is measured by the power module
+			cmdBuf.timestamp = 0;
+			trigger_submit(&cmdBuf);
 		}
-		vTaskDelay(1);
+	}
+#endif
+
+	while(1) {
+		int64_t timestamp;
+		xQueueReceive(xQueueGpio, &timestamp, portMAX_DELAY);
+		ESP_LOGI(TAG, "%s at %"PRIi64"us, %"PRIi64"us ago", fire, timestamp, esp_timer_get_time() - timestamp);
+		cmdBuf.timestamp = timestamp;
+		trigger_submit(&cmdBuf);
 	}
 
 	/* Never reach */
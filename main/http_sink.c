@@ -0,0 +1,144 @@
+/* HTTP POST sink
+
+	The picture is posted to a HTTP server on the local network while the mail is being sent.
+	The body is the frame buffer itself, so the picture is not copied.
+	The connection is kept alive between the pictures.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_client.h"
+#include "esp_camera.h"
+
+#include "cmd.h"
+#include "trigger.h"
+#include "sink.h"
+#include "affinity.h"
+#include "wifi_manager.h"
+
+static const char *TAG = "HTTP";
+
+static QueueHandle_t xQueueHttp;
+static EventGroupHandle_t s_events;
+#define HTTP_IDLE BIT0
+
+static SINK_STATS_t s_sink_stats;
+
+static esp_err_t http_post(esp_http_client_handle_t client, SINK_FRAME_t *frame)
+{
+	char value[16];
+	esp_http_client_set_header(client, "Content-Type", "image/jpeg");
+	esp_http_client_set_header(client, "X-Camera-Name", frame->info.remoteFileName);
+	esp_http_client_set_header(client, "X-Camera-Source", trigger_source_name(frame->info.source));
+	sprintf(value, "%"PRIu32, frame->info.triggerId);
+	esp_http_client_set_header(client, "X-Camera-Trigger", value);
+	sprintf(value, "%dx%d", frame->fb->width, frame->fb->height);
+	esp_http_client_set_header(client, "X-Camera-Size", value);
+	esp_http_client_set_post_field(client, (const char *)frame->fb->buf, frame->fb->len);
+
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = esp_http_client_perform(client);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "POST failed: %s", esp_err_to_name(err));
+		// Open a new connection for the next picture
+		esp_http_client_close(client);
+		return err;
+	}
+	int status = esp_http_client_get_status_code(client);
+	int64_t elapsed = esp_timer_get_time() - start;
+	ESP_LOGI(TAG, "POST %d bytes id=%"PRIu32" status=%d in %"PRIi64"us", frame->fb->len, frame->info.triggerId, status, elapsed);
+	if (status < 200 || status > 299) return ESP_FAIL;
+	return ESP_OK;
+}
+
+static void http_sink_task(void *pvParameters)
+{
+	// The client is made after the network is up
+	wifi_manager_wait(portMAX_DELAY);
+	esp_http_client_config_t config = {
+		.url = CONFIG_HTTP_SINK_URL,
+		.method = HTTP_METHOD_POST,
+		.timeout_ms = CONFIG_HTTP_SINK_TIMEOUT * 1000,
+		.keep_alive_enable = true,
+	};
+	esp_http_client_handle_t client = esp_http_client_init(&config);
+	configASSERT( client );
+	ESP_LOGI(TAG, "Start URL=%s", CONFIG_HTTP_SINK_URL);
+
+	while (1) {
+		SINK_FRAME_t *frame;
+		xQueueReceive(xQueueHttp, &frame, portMAX_DELAY);
+		// The frame buffer can not be kept while the network is down
+		esp_err_t ret = ESP_ERR_INVALID_STATE;
+		if (wifi_manager_connected()) ret = http_post(client, frame);
+		sink_stats_update(&s_sink_stats, ret, frame->fb->len, frame->info.triggerTime);
+		sink_frame_unref(frame);
+		if (uxQueueMessagesWaiting(xQueueHttp) == 0) xEventGroupSetBits(s_events, HTTP_IDLE);
+	}
+
+	/* Never reach */
+	vTaskDelete(NULL);
+}
+
+static esp_err_t http_sink_submit(SINK_FRAME_t *frame)
+{
+	if (frame->suppressed || frame->fb == NULL) {
+		sink_stats_update(&s_sink_stats, ESP_ERR_NOT_SUPPORTED, 0, 0);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	// The camera task does not wait for the network
+	if (wifi_manager_connected() == false) {
+		sink_stats_update(&s_sink_stats, ESP_ERR_INVALID_STATE, 0, 0);
+		return ESP_ERR_INVALID_STATE;
+	}
+	xEventGroupClearBits(s_events, HTTP_IDLE);
+	sink_frame_ref(frame);
+	if (xQueueSend(xQueueHttp, &frame, 0) != pdPASS) {
+		sink_frame_unref(frame);
+		if (uxQueueMessagesWaiting(xQueueHttp) == 0) xEventGroupSetBits(s_events, HTTP_IDLE);
+		sink_stats_update(&s_sink_stats, ESP_FAIL, 0, 0);
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+// The frame buffer is needed for the next picture
+static void http_sink_flush(void)
+{
+	xEventGroupWaitBits(s_events, HTTP_IDLE, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+static void http_sink_stats(SINK_STATS_t *stats)
+{
+	*stats = s_sink_stats;
+}
+
+const SINK_t http_sink = {
+	.name = "HTTP",
+	.usesFrameBuffer = true,
+	.submit = http_sink_submit,
+	.flush = http_sink_flush,
+	.stats = http_sink_stats,
+};
+
+void http_sink_init(void)
+{
+	xQueueHttp = xQueueCreate(2, sizeof(SINK_FRAME_t *));
+	configASSERT( xQueueHttp );
+	s_events = xEventGroupCreate();
+	configASSERT( s_events );
+	xEventGroupSetBits(s_events, HTTP_IDLE);
+	xTaskCreatePinnedToCore(http_sink_task, "HTTP", 1024*4, NULL, 4, NULL, NETWORK_CORE);
+}
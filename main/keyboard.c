@@ -1,24 +1,136 @@
 /* The example of Keyboard Input
+ *
+ * The console is read through the UART driver, so the task blocks until a line arrives.
+ * Commands:
+ *   (Enter)                  take a picture
+ *   take [framesize=VGA ...] take a picture with parameters
+ *   burst N [INTERVAL_MS]    submit N triggers
+ *   stats                    display the statistics of triggers
+ *   set quality N            set the parameter for the following pictures
+ *   set default              clear the parameters
  *
  * This sample code is in the public domain.
  */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "driver/uart.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+#include "driver/uart_vfs.h"
+#else
+#include "esp_vfs_dev.h"
+#endif
 #include "cmd.h"
-
-extern QueueHandle_t xQueueCmd;
+#include "trigger.h"
 
 static const char *TAG = "KEYBOARD";
 
+#if CONFIG_ESP_CONSOLE_UART
+// Make stdin blocking by the UART driver
+static void console_init(void)
+{
+	fflush(stdout);
+	setvbuf(stdin, NULL, _IONBF, 0);
+	ESP_ERROR_CHECK(uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0));
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+	uart_vfs_dev_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+#else
+	esp_vfs_dev_uart_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+#endif
+}
+
+static void burst(CMD_t *cmd, int count, int interval)
+{
+	int results[3] = {0, 0, 0};
+	int64_t start = esp_timer_get_time();
+	for (int i=0; i<count; i++) {
+		CMD_t trigger = *cmd;
+		results[trigger_submit(&trigger)]++;
+		if (interval) vTaskDelay(pdMS_TO_TICKS(interval));
+	}
+	ESP_LOGI(TAG, "burst %d triggers in %"PRIi64"us %s=%d %s=%d %s=%d", count, esp_timer_get_time() - start,
+		trigger_result_name(TRIGGER_ACCEPTED), results[TRIGGER_ACCEPTED],
+		trigger_result_name(TRIGGER_COALESCED), results[TRIGGER_COALESCED],
+		trigger_result_name(TRIGGER_DROPPED), results[TRIGGER_DROPPED]);
+}
+
+static void execute(char *line, CMD_t *session)
+{
+	char *save;
+	char *command = strtok_r(line, " \t", &save);
+	char *args = strtok_r(NULL, "", &save);
+	if (command == NULL || strcmp(command, "take") == 0) {
+		ESP_LOGI(TAG, "Push Enter");
+		CMD_t cmdBuf = *session;
+		if (args && cmd_parse_params(args, &cmdBuf) < 0) {
+			ESP_LOGW(TAG, "Invalid parameter");
+			return;
+		}
+		trigger_submit(&cmdBuf);
+	} else if (strcmp(command, "burst") == 0) {
+		int count = 0;
+		int interval = 0;
+		if (args == NULL || sscanf(args, "%d %d", &count, &interval) < 1 || count <= 0) {
+			ESP_LOGW(TAG, "burst N [INTERVAL_MS]");
+			return;
+		}
+		burst(session, count, interval);
+	} else if (strcmp(command, "stats") == 0) {
+		trigger_dump();
+	} else if (strcmp(command, "set") == 0) {
+		char name[16];
+		char value[16];
+		if (args && strcmp(args, "default") == 0) {
+			cmd_init(session, CMD_TAKE, SOURCE_KEYBOARD);
+		} else if (args && sscanf(args, "%15s %15s", name, value) == 2) {
+			// set quality 10 is same as quality=10
+			char param[34];
+			sprintf(param, "%s=%s", name, value);
+			CMD_t cmdBuf = *session;
+			if (cmd_parse_params(param, &cmdBuf) <= 0) {
+				ESP_LOGW(TAG, "Invalid parameter");
+				return;
+			}
+			*session = cmdBuf;
+		} else {
+			ESP_LOGW(TAG, "set quality|framesize|flash VALUE or set default");
+			return;
+		}
+		ESP_LOGI(TAG, "framesize=%d quality=%d flash=%d (%d is default)",
+			session->framesize, session->quality, session->flash, PARAM_DEFAULT);
+	} else {
+		ESP_LOGW(TAG, "Unknown command [%s]. take, burst, stats or set", command);
+	}
+}
+#endif
+
 void keyin(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start");
 	CMD_t cmdBuf;
-	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
+	cmd_init(&cmdBuf, CMD_TAKE, SOURCE_KEYBOARD);
 
+#if CONFIG_ESP_CONSOLE_UART
+	console_init();
+	char line[128];
+	while (1) {
+		if (fgets(line, sizeof(line), stdin) == NULL) {
+			clearerr(stdin);
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = 0;
+		ESP_LOGI(TAG, "line=[%s]", line);
+		execute(line, &cmdBuf);
+	}
+#else
+	// The console is not UART, so it is polled
 	uint16_t c;
 	while (1) {
 		c = fgetc(stdin);
@@ -29,11 +141,10 @@ void keyin(void *pvParameters)
 		//ESP_LOGI(TAG, "c=%x", c);
 		if (c == 0x0a) {
 			ESP_LOGI(TAG, "Push Enter");
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
-			}
+			trigger_submit(&cmdBuf);
 		}
 	}
+#endif
 
 	/* Never reach */
 	vTaskDelete( NULL );
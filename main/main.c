@@ -13,6 +13,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 
@@ -25,11 +26,11 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
 #include "esp_sntp.h"
-#include "mdns.h"
 #include "lwip/dns.h"
 #include "driver/gpio.h"
 
@@ -37,23 +38,45 @@
 #include "camera_pin.h"
 
 #include "cmd.h"
-
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_wifi_event_group;
-
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+#include "affinity.h"
+#include "archive.h"
+#include "trigger.h"
+#include "discovery.h"
+#include "wifi_manager.h"
+#include "sink.h"
+#if CONFIG_DEEP_SLEEP
+#include "power.h"
+#endif
 
 static const char *TAG = "MAIN";
 
-static int s_retry_num = 0;
-
 QueueHandle_t xQueueCmd;
 QueueHandle_t xQueueSmtp;
-SemaphoreHandle_t xSemaphoreSmtp;
+SemaphoreHandle_t xSemaphoreSmtpDone; // Free slots of the mail. Given by the SMTP task when a mail is done
+
+/* The boot steps run at the same time, and each one sets its bit when it is done */
+static EventGroupHandle_t s_boot_group;
+#define BOOT_CAMERA BIT0
+#define BOOT_STORAGE BIT1
+#define BOOT_NETWORK BIT2
+#define BOOT_TIME BIT3
+#define BOOT_CAPTURE BIT4
+
+/* Boot timeline */
+typedef struct {
+	const char *name;
+	int64_t start;
+	int64_t end;
+} BOOT_PHASE_t;
+
+#define BOOT_PHASES 12
+static BOOT_PHASE_t s_boot_phases[BOOT_PHASES];
+static int s_boot_count = 0;
+static portMUX_TYPE s_boot_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t s_wifi_start;
+#if CONFIG_REMOTE_IS_VARIABLE_NAME
+static int64_t s_sntp_start;
+#endif
 
 //static camera_config_t camera_config = {
 camera_config_t camera_config = {
@@ -87,6 +110,32 @@ camera_config_t camera_config = {
 	.fb_count = 1		//if more than one, i2s runs in continuous mode. Use only with JPEG
 };
 
+// Record the phase that started at start and ends now. The time is counted from the reset.
+static void boot_phase(const char *name, int64_t start)
+{
+	int64_t end = esp_timer_get_time();
+	taskENTER_CRITICAL(&s_boot_mux);
+	if (s_boot_count < BOOT_PHASES) {
+		s_boot_phases[s_boot_count].name = name;
+		s_boot_phases[s_boot_count].start = start;
+		s_boot_phases[s_boot_count].end = end;
+		s_boot_count++;
+	}
+	taskEXIT_CRITICAL(&s_boot_mux);
+	ESP_LOGI(TAG, "boot %s done at %"PRIi64"ms (%"PRIi64"ms)", name, end / 1000, (end - start) / 1000);
+}
+
+static void boot_dump(void)
+{
+	ESP_LOGI(TAG, "Boot timeline");
+	ESP_LOGI(TAG, "%-16s %8s %8s %8s", "phase", "start", "end", "elapsed");
+	for (int i=0; i<s_boot_count; i++) {
+		BOOT_PHASE_t *phase = &s_boot_phases[i];
+		ESP_LOGI(TAG, "%-16s %6"PRIi64"ms %6"PRIi64"ms %6"PRIi64"ms", phase->name,
+			phase->start / 1000, phase->end / 1000, (phase->end - phase->start) / 1000);
+	}
+}
+
 static esp_err_t init_camera(int framesize)
 {
 	//initialize the camera
@@ -101,174 +150,186 @@ static esp_err_t init_camera(int framesize)
 	return ESP_OK;
 }
 
-static esp_err_t camera_capture(char * FileName, size_t *pictureSize)
+#if CONFIG_ENABLE_DEDUPE || CONFIG_ENABLE_THUMBNAIL
+#include "preview.h"
+#endif
+
+#if CONFIG_ENABLE_DEDUPE
+esp_err_t phash_compute(const PREVIEW_t *preview, uint64_t *hash);
+int phash_distance(uint64_t a, uint64_t b);
+#endif
+
+#if CONFIG_ENABLE_QUALITY_CONTROL
+void quality_init(int quality, int framesize);
+void quality_get(int *quality, int *framesize);
+void quality_update(size_t len);
+#endif
+
+#if CONFIG_ENABLE_THUMBNAIL
+esp_err_t thumbnail_create(const PREVIEW_t *preview, char * FileName, size_t *thumbnailSize);
+#endif
+
+#if CONFIG_STORAGE_ARCHIVE
+#define STORAGE "Archive"
+#else
+#define STORAGE "SPIFFS"
+#endif
+
+#define CAPTURE_RETRY 3 // Failed captures retried before the trigger fails
+
+typedef struct {
+	size_t size;
+	int width;
+	int height;
+	int quality;
+	int64_t latency; // Time to acquire the frame in microseconds
+	uint64_t hash;
+	size_t thumbSize; // 0 when there is no thumbnail
+	uint32_t seq; // Sequence number in archive
+	int64_t writeTime; // Time to store the picture in microseconds
+	camera_fb_t *fb; // Frame buffer held for the sinks. NULL when it is returned
+} PICTURE_t;
+
+// Current settings of the sensor
+static int s_framesize;
+static int s_quality;
+
+// Configured settings
+static int s_default_framesize;
+static int s_default_quality;
+
+static void camera_defaults(int *framesize, int *quality)
+{
+	*framesize = s_default_framesize;
+	*quality = s_default_quality;
+#if CONFIG_ENABLE_QUALITY_CONTROL
+	quality_get(quality, framesize);
+#endif
+}
+
+// Switch the sensor settings between shots without esp_camera_init
+static esp_err_t camera_settings(int framesize, int quality)
+{
+	if (framesize == s_framesize && quality == s_quality) return ESP_OK;
+	sensor_t *s = esp_camera_sensor_get();
+	if (s == NULL) return ESP_FAIL;
+
+	int64_t start = esp_timer_get_time();
+	if (framesize != s_framesize) {
+		if (s->set_framesize(s, framesize) != 0) {
+			ESP_LOGE(TAG, "set_framesize fail");
+			return ESP_FAIL;
+		}
+		s_framesize = framesize;
+	}
+	if (quality != s_quality) {
+		if (s->set_quality(s, quality) != 0) {
+			ESP_LOGE(TAG, "set_quality fail");
+			return ESP_FAIL;
+		}
+		s_quality = quality;
+	}
+	ESP_LOGI(TAG, "Switch to framesize=%dx%d quality=%d elapsed=%"PRIi64"us",
+		resolution[framesize].width, resolution[framesize].height, quality, esp_timer_get_time() - start);
+	return ESP_OK;
+}
+
+static esp_err_t camera_capture(char * FileName, char * ThumbFileName, CMD_t *cmd, PICTURE_t *picture)
 {
+	picture->fb = NULL;
+	// The sensor settings given by the shutter take precedence over the configured settings
+	// The quality controller only learns from pictures taken with the configured settings
+	int framesize, quality;
+	camera_defaults(&framesize, &quality);
+	bool feedback = true;
+	if (cmd->framesize != PARAM_DEFAULT) {
+		framesize = cmd->framesize;
+		feedback = false;
+	}
+	if (cmd->quality != PARAM_DEFAULT) {
+		quality = cmd->quality;
+		feedback = false;
+	}
+	// The picture is not taken with other settings than requested
+	if (camera_settings(framesize, quality) != ESP_OK) return ESP_ERR_NOT_SUPPORTED;
+
 	//clear internal queue
 	//for(int i=0;i<2;i++) {
 	for(int i=0;i<1;i++) {
 		camera_fb_t * fb = esp_camera_fb_get();
+		if (!fb) continue;
 		ESP_LOGI(TAG, "fb->len=%d", fb->len);
 		esp_camera_fb_return(fb);
 	}
 
 	//acquire a frame
+	int64_t start = esp_timer_get_time();
 	camera_fb_t * fb = esp_camera_fb_get();
 	if (!fb) {
 		ESP_LOGE(TAG, "Camera Capture Failed");
 		return ESP_FAIL;
 	}
+	picture->latency = esp_timer_get_time() - start;
 
 	//replace this with your own function
 	//process_image(fb->width, fb->height, fb->format, fb->buf, fb->len);
+	picture->hash = 0;
+	picture->thumbSize = 0;
+#if CONFIG_ENABLE_DEDUPE || CONFIG_ENABLE_THUMBNAIL
+	// The hash and the thumbnail are made from one decode
+	PREVIEW_t preview;
+	if (preview_decode(fb->buf, fb->len, &preview) == ESP_OK) {
+#if CONFIG_ENABLE_DEDUPE
+		if (phash_compute(&preview, &picture->hash) != ESP_OK) {
+			picture->hash = 0;
+		}
+#endif
+#if CONFIG_ENABLE_THUMBNAIL
+		if (thumbnail_create(&preview, ThumbFileName, &picture->thumbSize) != ESP_OK) {
+			picture->thumbSize = 0;
+		}
+#endif
+		preview_free(&preview);
+	}
+#endif
+	int64_t write_start = esp_timer_get_time();
+#if CONFIG_STORAGE_ARCHIVE
+	if (archive_write(fb->buf, fb->len, fb->width, fb->height, time(NULL), &picture->seq) != ESP_OK) {
+		esp_camera_fb_return(fb);
+		return ESP_FAIL;
+	}
+#else
 	FILE* f = fopen(FileName, "wb");
 	if (f == NULL) {
 		ESP_LOGE(TAG, "Failed to open file for writing");
+		esp_camera_fb_return(fb);
 		return ESP_FAIL;
 	}
 	fwrite(fb->buf, fb->len, 1, f);
-	ESP_LOGI(TAG, "fb->len=%d", fb->len);
-	*pictureSize = (size_t)fb->len;
 	fclose(f);
-
-	//return the frame buffer back to the driver for reuse
-	esp_camera_fb_return(fb);
-	return ESP_OK;
-}
-
-static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
-{
-	if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-		esp_wifi_connect();
-	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-		if (s_retry_num < CONFIG_ESP_MAXIMUM_RETRY) {
-			esp_wifi_connect();
-			s_retry_num++;
-			ESP_LOGI(TAG, "retry to connect to the AP");
-		} else {
-			xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-		}
-		ESP_LOGI(TAG,"connect to the AP fail");
-	} else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-		ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-		ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-		s_retry_num = 0;
-		xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-	}
-}
-
-#if CONFIG_STATIC_IP
-static esp_err_t example_set_dns_server(esp_netif_t *netif, uint32_t addr, esp_netif_dns_type_t type)
-{
-	if (addr && (addr != IPADDR_NONE)) {
-		esp_netif_dns_info_t dns;
-		dns.ip.u_addr.ip4.addr = addr;
-		dns.ip.type = IPADDR_TYPE_V4;
-		ESP_ERROR_CHECK(esp_netif_set_dns_info(netif, type, &dns));
-	}
-	return ESP_OK;
-}
+	picture->seq = 0;
+#endif
+	picture->writeTime = esp_timer_get_time() - write_start;
+	ESP_LOGI(TAG, "fb->len=%d", fb->len);
+	picture->size = (size_t)fb->len;
+	picture->width = fb->width;
+	picture->height = fb->height;
+	picture->quality = s_quality;
+#if CONFIG_ENABLE_QUALITY_CONTROL
+	// Only the delivered frame is fed back. The new settings are applied before the flush frame of the next picture
+	if (feedback) quality_update(fb->len);
 #endif
 
-esp_err_t wifi_init_sta()
-{
-	s_wifi_event_group = xEventGroupCreate();
-
-	ESP_ERROR_CHECK(esp_netif_init());
-	ESP_ERROR_CHECK(esp_event_loop_create_default());
-	esp_netif_t *netif = esp_netif_create_default_wifi_sta();
-	assert(netif);
-
-#if CONFIG_STATIC_IP
-
-	ESP_LOGI(TAG, "CONFIG_STATIC_IP_ADDRESS=[%s]",CONFIG_STATIC_IP_ADDRESS);
-	ESP_LOGI(TAG, "CONFIG_STATIC_GW_ADDRESS=[%s]",CONFIG_STATIC_GW_ADDRESS);
-	ESP_LOGI(TAG, "CONFIG_STATIC_NM_ADDRESS=[%s]",CONFIG_STATIC_NM_ADDRESS);
-
-	/* Stop DHCP client */
-	ESP_ERROR_CHECK(esp_netif_dhcpc_stop(netif));
-	ESP_LOGI(TAG, "Stop DHCP Services");
-
-	/* Set STATIC IP Address */
-	esp_netif_ip_info_t ip_info;
-	memset(&ip_info, 0 , sizeof(esp_netif_ip_info_t));
-	ip_info.ip.addr = ipaddr_addr(CONFIG_STATIC_IP_ADDRESS);
-	ip_info.netmask.addr = ipaddr_addr(CONFIG_STATIC_NM_ADDRESS);
-	ip_info.gw.addr = ipaddr_addr(CONFIG_STATIC_GW_ADDRESS);;
-	ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
-
-	/* Set DNS Server */
-	ESP_ERROR_CHECK(example_set_dns_server(netif, ipaddr_addr("8.8.8.8"), ESP_NETIF_DNS_MAIN));
-	ESP_ERROR_CHECK(example_set_dns_server(netif, ipaddr_addr("8.8.4.4"), ESP_NETIF_DNS_BACKUP));
-
-#endif // CONFIG_STATIC_IP
-
-	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-	ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-	esp_event_handler_instance_t instance_any_id;
-	esp_event_handler_instance_t instance_got_ip;
-	ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-		ESP_EVENT_ANY_ID,
-		&event_handler,
-		NULL,
-		&instance_any_id));
-	ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-		IP_EVENT_STA_GOT_IP,
-		&event_handler,
-		NULL,
-		&instance_got_ip));
-
-	wifi_config_t wifi_config = {
-		.sta = {
-			.ssid = CONFIG_ESP_WIFI_SSID,
-			.password = CONFIG_ESP_WIFI_PASSWORD
-		},
-	};
-	ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
-	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-	ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-	ESP_ERROR_CHECK(esp_wifi_start());
-
-	/* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-	 * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-esp_err_t ret_value = ESP_OK;
-	EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-		WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-		pdFALSE,
-		pdFALSE,
-		portMAX_DELAY);
-
-	/* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-	 * happened. */
-	if (bits & WIFI_CONNECTED_BIT) {
-		ESP_LOGI(TAG, "connected to ap SSID:%s password:%s", CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASSWORD);
-	} else if (bits & WIFI_FAIL_BIT) {
-		ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s", CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASSWORD);
-		ret_value = ESP_FAIL;
-	} else {
-		ESP_LOGE(TAG, "UNEXPECTED EVENT");
-		ret_value = ESP_FAIL;
+	//the frame buffer is shared by the sinks after the picture is stored
+	bool hold = cmd->direct || sink_uses_frame_buffer();
+	if (hold) {
+		picture->fb = fb;
+		return ESP_OK;
 	}
 
-	/* The event will not be processed after unregister */
-	ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-	ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-	vEventGroupDelete(s_wifi_event_group);
-	return ret_value;
-}
-
-void initialise_mdns(void)
-{
-	//initialize mDNS
-	ESP_ERROR_CHECK( mdns_init() );
-	//set mDNS hostname (required if you want to advertise services)
-	ESP_ERROR_CHECK( mdns_hostname_set(CONFIG_MDNS_HOSTNAME) );
-	ESP_LOGI(TAG, "mdns hostname set to: [%s]", CONFIG_MDNS_HOSTNAME);
-
-#if 0
-	//set default mDNS instance name
-	ESP_ERROR_CHECK( mdns_instance_name_set("ESP32 with mDNS") );
-#endif
+	//return the frame buffer back to the driver for reuse
+	esp_camera_fb_return(fb);
+	return ESP_OK;
 }
 
 esp_err_t mountSPIFFS(char * partition_label, char * base_path) {
@@ -311,6 +372,10 @@ esp_err_t mountSPIFFS(char * partition_label, char * base_path) {
 void time_sync_notification_cb(struct timeval *tv)
 {
 	ESP_LOGI(TAG, "Notification of a time synchronization event");
+	if ((xEventGroupGetBits(s_boot_group) & BOOT_TIME) == 0) {
+		boot_phase("time", s_sntp_start);
+		xEventGroupSetBits(s_boot_group, BOOT_TIME);
+	}
 }
 
 static void initialize_sntp(void)
@@ -323,21 +388,6 @@ static void initialize_sntp(void)
 	sntp_set_time_sync_notification_cb(time_sync_notification_cb);
 	esp_sntp_init();
 }
-
-static esp_err_t obtain_time(void)
-{
-	initialize_sntp();
-	// wait for time to be set
-	int retry = 0;
-	const int retry_count = 10;
-	while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-		ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-		vTaskDelay(2000 / portTICK_PERIOD_MS);
-	}
-
-	if (retry == retry_count) return ESP_FAIL;
-	return ESP_OK;
-}
 #endif
 
 #if 0
@@ -353,6 +403,14 @@ static void SPIFFS_Directory(char * path) {
 }
 #endif
 
+static void got_ip_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+	if ((xEventGroupGetBits(s_boot_group) & BOOT_NETWORK) == 0) {
+		boot_phase("network", s_wifi_start);
+		xEventGroupSetBits(s_boot_group, BOOT_NETWORK);
+	}
+}
+
 #if CONFIG_SHUTTER_ENTER
 void keyin(void *pvParameters);
 #endif
@@ -363,6 +421,7 @@ void gpio(void *pvParameters);
 
 #if CONFIG_SHUTTER_TCP
 void tcp_server(void *pvParameters);
+extern const SINK_t tcp_sink;
 #endif
 
 #if CONFIG_SHUTTER_UDP
@@ -372,122 +431,93 @@ void udp_server(void *pvParameters);
 #if CONFIG_SHUTTER_MQTT
 void mqtt_client(void *pvParameters);
 #endif
+#if CONFIG_MQTT_IMAGE_SINK
+extern const SINK_t mqtt_sink;
+#endif
+
+#if CONFIG_HTTP_SINK
+void http_sink_init(void);
+extern const SINK_t http_sink;
+#endif
 
 void smtp_client_task(void *pvParameters);
+esp_err_t smtp_slot_reserve(char *localFileName, char *thumbFileName);
+void smtp_slot_release(void);
+extern const SINK_t smtp_sink;
 
-void app_main(void)
+// Submit the picture to all sinks at once, and wait until they are done with the frame buffer
+// The suppressed picture is sent only to the shutter that requested it
+static void deliver(SMTP_t *smtpBuf, PICTURE_t *picture, CMD_t *cmd, bool suppressed)
 {
-	// Initialize NVS
-	esp_err_t ret = nvs_flash_init();
-	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-		ESP_ERROR_CHECK(nvs_flash_erase());
-		ret = nvs_flash_init();
-	}
-	ESP_ERROR_CHECK(ret);
-
-	// Initilize WiFi
-	ESP_ERROR_CHECK(wifi_init_sta());
-
-	// Initialize mDNS
-	initialise_mdns();
+	SINK_FRAME_t frame = {
+		.refs = 1,
+		.fb = picture->fb,
+		.info = *smtpBuf,
+		.direct = cmd->direct,
+		.suppressed = suppressed,
+	};
+	picture->fb = NULL;
+	int64_t start = esp_timer_get_time();
+	sink_submit(&frame);
+	sink_frame_unref(&frame);
+	sink_flush();
+	ESP_LOGI(TAG, "delivered id=%"PRIu32" elapsed=%"PRIi64"us", cmd->id, esp_timer_get_time() - start);
+	sink_dump();
+}
 
+void camera_task(void *pvParameters)
+{
+	esp_err_t ret;
 #if CONFIG_REMOTE_IS_VARIABLE_NAME
-	// Obtain time over NTP
-	ESP_LOGI(TAG, "Connecting to WiFi and getting time over NTP.");
-	ESP_ERROR_CHECK(obtain_time());
-
-	// update 'now' variable with current time
 	time_t now;
 	struct tm timeinfo;
 	char strftime_buf[64];
-	time(&now);
-	now = now + (CONFIG_LOCAL_TIMEZONE*60*60);
-	localtime_r(&now, &timeinfo);
-	strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-	ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
-#endif
-
-	// Initialize SPIFFS
-	ESP_LOGI(TAG, "Initializing SPIFFS");
-	char *partition_label = "storage";
-	char *base_path = "/spiffs";
-	ESP_ERROR_CHECK(mountSPIFFS(partition_label, base_path));
-
-#if CONFIG_ENABLE_FLASH
-	// Enable Flash Light
-	//gpio_pad_select_gpio(CONFIG_GPIO_FLASH);
-	gpio_reset_pin(CONFIG_GPIO_FLASH);
-	gpio_set_direction(CONFIG_GPIO_FLASH, GPIO_MODE_OUTPUT);
-	gpio_set_level(CONFIG_GPIO_FLASH, 0);
-#endif
-
-	/* Create Queue */
-	xQueueCmd = xQueueCreate( 1, sizeof(CMD_t) );
-	xQueueSmtp = xQueueCreate( 1, sizeof(SMTP_t) );
-	configASSERT( xQueueCmd );
-	configASSERT( xQueueSmtp );
-
-	/* Create Semaphore */
-	xSemaphoreSmtp = xSemaphoreCreateBinary();
-	configASSERT( xSemaphoreSmtp );
-
-	/* Create SMTP Client Task */
-	xTaskCreate(&smtp_client_task, "smtp_client_task", 8*1024, NULL, 5, NULL);
-
-	/* Create Shutter Task */
-#if CONFIG_SHUTTER_ENTER
-#define SHUTTER "Keybord Enter"
-	xTaskCreate(keyin, "KEYIN", 1024*4, NULL, 2, NULL);
-#endif
-
-#if CONFIG_SHUTTER_GPIO
-#define SHUTTER "GPIO Input"
-	xTaskCreate(gpio, "GPIO", 1024*4, NULL, 2, NULL);
-#endif
-
-#if CONFIG_SHUTTER_TCP
-#define SHUTTER "TCP Input"
-	xTaskCreate(tcp_server, "TCP", 1024*4, NULL, 2, NULL);
-#endif
-
-#if CONFIG_SHUTTER_UDP
-#define SHUTTER "UDP Input"
-	xTaskCreate(udp_server, "UDP", 1024*4, NULL, 2, NULL);
-#endif
-
-#if CONFIG_SHUTTER_MQTT
-#define SHUTTER "MQTT Publish"
-	xTaskCreate(mqtt_client, "MQTT", 1024*4, NULL, 2, NULL);
 #endif
 
 #if CONFIG_FRAMESIZE_VGA
 	int framesize = FRAMESIZE_VGA;
-	#define FRAMESIZE_STRING "640x480"
 #elif CONFIG_FRAMESIZE_SVGA
 	int framesize = FRAMESIZE_SVGA;
-	#define FRAMESIZE_STRING "800x600"
 #elif CONFIG_FRAMESIZE_XGA
 	int framesize = FRAMESIZE_XGA;
-	#define FRAMESIZE_STRING "1024x768"
 #elif CONFIG_FRAMESIZE_HD
 	int framesize = FRAMESIZE_HD;
-	#define FRAMESIZE_STRING "1280x720"
 #elif CONFIG_FRAMESIZE_SXGA
 	int framesize = FRAMESIZE_SXGA;
-	#define FRAMESIZE_STRING "1280x1024"
 #elif CONFIG_FRAMESIZE_UXGA
 	int framesize = FRAMESIZE_UXGA;
-	#define FRAMESIZE_STRING "1600x1200"
 #endif
 
 	/* Detect camera */
-	init_camera(framesize);
+	// The frame buffer is allocated for the largest frame size,
+	// so that the shutter can switch the frame size without esp_camera_init.
+	int64_t start = esp_timer_get_time();
+	if (init_camera(FRAMESIZE_UXGA) != ESP_OK) {
+		// No picture can be taken. The triggers are dropped, because the queue is not read
+		ESP_LOGE(TAG, "Camera is not available. Check the sensor and the pin configuration");
+		vTaskDelete(NULL);
+	}
+	s_framesize = camera_config.frame_size;
+	s_quality = camera_config.jpeg_quality;
+	s_default_framesize = framesize;
+	s_default_quality = camera_config.jpeg_quality;
+	camera_settings(s_default_framesize, s_default_quality);
+#if CONFIG_ENABLE_QUALITY_CONTROL
+	quality_init(s_default_quality, s_default_framesize);
+#endif
+	boot_phase("camera", start);
+	xEventGroupSetBits(s_boot_group, BOOT_CAMERA);
+
+	// The picture is written to the storage mounted by app_main
+	xEventGroupWaitBits(s_boot_group, BOOT_STORAGE, pdFALSE, pdTRUE, portMAX_DELAY);
 
 	SMTP_t	smtpBuf;
 	smtpBuf.command = CMD_SMTP;
 	smtpBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	sprintf(smtpBuf.localFileName, "/spiffs/picture.jpg");
-	ESP_LOGI(TAG, "localFileName=%s",smtpBuf.localFileName);
+	char thumbFileName[64];
+	smtpBuf.thumbFileName[0] = 0;
+	smtpBuf.thumbFileSize = 0;
+	smtpBuf.captureTime = 0;
 
 #if CONFIG_REMOTE_IS_FIXED_NAME
 #if CONFIG_REMOTE_FRAMESIZE
@@ -497,41 +527,184 @@ void app_main(void)
 		if (baseFileName[index] == 0x2E) baseFileName[index] = 0;
 	}
 	ESP_LOGI(TAG, "baseFileName=[%s]", baseFileName);
-	// picture_640x480.jpg
-	sprintf(smtpBuf.remoteFileName, "%s_%s.jpg", baseFileName, FRAMESIZE_STRING);
 #else
 	// picture.jpg
 	sprintf(smtpBuf.remoteFileName, "%s", CONFIG_FIXED_REMOTE_FILE);
-#endif
 	ESP_LOGI(TAG, "remoteFileName=%s",smtpBuf.remoteFileName);
 #endif
+#endif
+
+#if CONFIG_ENABLE_DEDUPE
+	bool hashValid = false;
+	uint64_t lastHash = 0;
+	uint32_t suppressed = 0;
+#endif
+
+	// Statistics of capture latency
+	uint32_t captureCount = 0;
+	int64_t latencyMin = INT64_MAX;
+	int64_t latencyMax = 0;
+	int64_t latencySum = 0;
+	int64_t writeMax = 0;
 
 	CMD_t cmdBuf;
 
 	while(1) {
-		ESP_LOGI(TAG,"Waitting %s ....", SHUTTER);
+		ESP_LOGI(TAG,"Waitting shutter ....");
 		xQueueReceive(xQueueCmd, &cmdBuf, portMAX_DELAY);
-		ESP_LOGI(TAG,"cmdBuf.command=%d", cmdBuf.command);
+		ESP_LOGI(TAG,"cmdBuf.command=%d source=%s", cmdBuf.command, trigger_source_name(cmdBuf.source));
 		if (cmdBuf.command == CMD_HALT) break;
 
-		// Delete local file
+		// The picture waits in a slot until the mail is sent.
+		// The camera does not wait for the network, so the trigger fails when all slots are waiting.
+		if (smtp_slot_reserve(smtpBuf.localFileName, thumbFileName) != ESP_OK) {
+			ESP_LOGE(TAG, "No slot for the mail. id=%"PRIu32" is not taken", cmdBuf.id);
+			cmd_post_event(CAMERA_EVENT_FAILED, cmdBuf.id, cmdBuf.source, cmdBuf.timestamp);
+			continue;
+		}
+		ESP_LOGI(TAG, "localFileName=%s",smtpBuf.localFileName);
+
+		// Delete local file of the slot
+#if CONFIG_STORAGE_SPIFFS || CONFIG_ENABLE_THUMBNAIL
 		struct stat statBuf;
+#endif
+#if CONFIG_STORAGE_SPIFFS
 		if (stat(smtpBuf.localFileName, &statBuf) == 0) {
 			// Delete it if it exists
 			unlink(smtpBuf.localFileName);
 		}
+#endif
+#if CONFIG_ENABLE_THUMBNAIL
+		if (stat(thumbFileName, &statBuf) == 0) {
+			unlink(thumbFileName);
+		}
+#endif
+
+#if CONFIG_REMOTE_IS_VARIABLE_NAME
+		int64_t captured = esp_timer_get_time();
+#endif
+
+#if CONFIG_ENABLE_FLASH
+		// Flash Light ON
+		bool flash = (cmdBuf.flash == PARAM_DEFAULT) ? true : (cmdBuf.flash != 0);
+		if (flash) gpio_set_level(CONFIG_GPIO_FLASH, 1);
+#endif
+
+		// Save Picture to Local file
+		int retryCounter = 0;
+		PICTURE_t picture;
+		picture.fb = NULL;
+		while(1) {
+			// The frame of the failed capture is not sent
+			if (picture.fb) esp_camera_fb_return(picture.fb);
+			ret = camera_capture(smtpBuf.localFileName, thumbFileName, &cmdBuf, &picture);
+			ESP_LOGI(TAG, "camera_capture=%d",ret);
+			// The settings can not be applied, so another capture does not help
+			if (ret == ESP_ERR_NOT_SUPPORTED) break;
+			if (ret != ESP_OK) {
+				retryCounter++;
+				if (retryCounter > CAPTURE_RETRY) break;
+				ESP_LOGW(TAG, "Retry capture %d",retryCounter);
+				vTaskDelay(pdMS_TO_TICKS(100));
+				continue;
+			}
+			ESP_LOGI(TAG, "pictureSize=%d",picture.size);
+			smtpBuf.localFileSize = picture.size;
+			smtpBuf.archiveSeq = picture.seq;
+#if CONFIG_STORAGE_ARCHIVE
+			// The archive has verified the write
+			break;
+#else
+			struct stat statBuf;
+			if (stat(smtpBuf.localFileName, &statBuf) == 0) {
+				ESP_LOGI(TAG, "st_size=%d", (int)statBuf.st_size);
+				if (statBuf.st_size == picture.size) break;
+			}
+			retryCounter++;
+			ESP_LOGI(TAG, "Retry capture %d",retryCounter);
+			if (retryCounter > 10) {
+				ESP_LOGE(TAG, "Retry over for capture");
+				break;
+			}
+			vTaskDelay(1000);
+#endif
+		} // end while
+
+		if (ret != ESP_OK) {
+#if CONFIG_ENABLE_FLASH
+			gpio_set_level(CONFIG_GPIO_FLASH, 0);
+#endif
+			smtp_slot_release();
+			ESP_LOGE(TAG, "No picture is taken for id=%"PRIu32" (%s)", cmdBuf.id, esp_err_to_name(ret));
+			cmd_post_event(CAMERA_EVENT_FAILED, cmdBuf.id, cmdBuf.source, cmdBuf.timestamp);
+			continue;
+		}
+
+		trigger_done(&cmdBuf);
+		trigger_dump();
+		if (captureCount == 0) {
+			boot_phase("first capture", 0);
+			xEventGroupSetBits(s_boot_group, BOOT_CAPTURE);
+		}
+		cmd_post_event(CAMERA_EVENT_CAPTURED, cmdBuf.id, cmdBuf.source, cmdBuf.timestamp);
+		smtpBuf.triggerId = cmdBuf.id;
+		smtpBuf.source = cmdBuf.source;
+		smtpBuf.triggerTime = cmdBuf.timestamp;
+		strcpy(smtpBuf.to, cmdBuf.to);
+
+		captureCount++;
+		latencySum += picture.latency;
+		if (picture.latency < latencyMin) latencyMin = picture.latency;
+		if (picture.latency > latencyMax) latencyMax = picture.latency;
+		ESP_LOGI(TAG, "capture latency=%"PRIi64"us min=%"PRIi64"us max=%"PRIi64"us avg=%"PRIi64"us jitter=%"PRIi64"us core=%d",
+			picture.latency, latencyMin, latencyMax, latencySum / captureCount, latencyMax - latencyMin, xPortGetCoreID());
+		if (picture.writeTime > writeMax) writeMax = picture.writeTime;
+		ESP_LOGI(TAG, "%s write=%"PRIi64"us max=%"PRIi64"us", STORAGE, picture.writeTime, writeMax);
+
+#if CONFIG_ENABLE_FLASH
+		// Flash Light OFF
+		gpio_set_level(CONFIG_GPIO_FLASH, 0);
+#endif
 
 #if CONFIG_REMOTE_IS_VARIABLE_NAME
+		// The picture taken before the time is synchronized is named after the synchronization
+		if ((xEventGroupGetBits(s_boot_group) & BOOT_TIME) == 0) {
+			ESP_LOGW(TAG, "Waiting for the time over NTP...");
+			xEventGroupWaitBits(s_boot_group, BOOT_TIME, pdFALSE, pdTRUE, pdMS_TO_TICKS(CONFIG_NTP_TIMEOUT * 1000));
+		}
 		time(&now);
+		now = now - (esp_timer_get_time() - captured) / 1000000;
 		now = now + (CONFIG_LOCAL_TIMEZONE*60*60);
 		localtime_r(&now, &timeinfo);
 		strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-		ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
+		ESP_LOGI(TAG, "The date/time of capture is: %s", strftime_buf);
+		smtpBuf.captureTime = now;
+#endif
+
+#if CONFIG_ENABLE_THUMBNAIL
+		if (picture.thumbSize) {
+			strcpy(smtpBuf.thumbFileName, thumbFileName);
+		} else {
+			smtpBuf.thumbFileName[0] = 0;
+		}
+		smtpBuf.thumbFileSize = picture.thumbSize;
+#endif
+		smtpBuf.width = picture.width;
+		smtpBuf.height = picture.height;
+		smtpBuf.quality = picture.quality;
+
+		// The frame size may differ from the configuration, so it is taken from the picture
+#if CONFIG_REMOTE_IS_FIXED_NAME && CONFIG_REMOTE_FRAMESIZE
+		// picture_640x480.jpg
+		sprintf(smtpBuf.remoteFileName, "%s_%dx%d.jpg", baseFileName, picture.width, picture.height);
+		ESP_LOGI(TAG, "remoteFileName: %s", smtpBuf.remoteFileName);
+#endif
+#if CONFIG_REMOTE_IS_VARIABLE_NAME
 #if CONFIG_REMOTE_FRAMESIZE
 		// 20220927-110940_640x480.jpg
-		sprintf(smtpBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d_%s.jpg",
+		sprintf(smtpBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d_%dx%d.jpg",
 		(timeinfo.tm_year+1900),(timeinfo.tm_mon+1),timeinfo.tm_mday,
-		timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec, FRAMESIZE_STRING);
+		timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec, picture.width, picture.height);
 #else
 		// 20220927-110742.jpg
 		sprintf(smtpBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d.jpg",
@@ -541,47 +714,191 @@ void app_main(void)
 		ESP_LOGI(TAG, "remoteFileName: %s", smtpBuf.remoteFileName);
 #endif
 
+#if CONFIG_ENABLE_DEDUPE
+		// Skip pictures that look the same as the last one sent
+		// picture.hash is 0 when the hash could not be computed
+		if (hashValid && picture.hash != 0) {
+			int distance = phash_distance(lastHash, picture.hash);
+			ESP_LOGI(TAG, "Hamming distance from last picture=%d", distance);
+			if (distance <= CONFIG_DEDUPE_DISTANCE) {
+				suppressed++;
+				ESP_LOGW(TAG, "Near-duplicate picture suppressed. suppressed=%"PRIu32, suppressed);
+				deliver(&smtpBuf, &picture, &cmdBuf, true);
+#if CONFIG_STORAGE_ARCHIVE
+				archive_set_state(picture.seq, ARCHIVE_STATE_SUPPRESSED);
+#endif
+				cmd_post_event(CAMERA_EVENT_SUPPRESSED, cmdBuf.id, cmdBuf.source, cmdBuf.timestamp);
+				continue;
+			}
+		}
+		lastHash = picture.hash;
+		hashValid = (picture.hash != 0);
+#endif
+
+		// Send Mail and deliver to the other sinks
+		deliver(&smtpBuf, &picture, &cmdBuf, false);
 
-#if CONFIG_ENABLE_FLASH
-		// Flash Light ON
-		gpio_set_level(CONFIG_GPIO_FLASH, 1);
+	} // end while
+
+	/* Never reach */
+	vTaskDelete(NULL);
+}
+
+// WiFi, NTP, mDNS and the tasks that use the network
+static void network_start(void)
+{
+	// Start WiFi. The connection is made in the background
+	s_wifi_start = esp_timer_get_time();
+	ESP_ERROR_CHECK(wifi_manager_start());
+	ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip_handler, NULL, NULL));
+	boot_phase("wifi start", s_wifi_start);
+
+#if CONFIG_REMOTE_IS_VARIABLE_NAME
+	// Obtain time over NTP in the background
+	s_sntp_start = esp_timer_get_time();
+	initialize_sntp();
 #endif
 
-		// Save Picture to Local file
-		int retryCounter = 0;
-		while(1) {
-			size_t pictureSize;
-			ret = camera_capture(smtpBuf.localFileName, &pictureSize);
-			ESP_LOGI(TAG, "camera_capture=%d",ret);
-			ESP_LOGI(TAG, "pictureSize=%d",pictureSize);
-			smtpBuf.localFileSize = pictureSize;
-			if (ret != ESP_OK) continue;
-			struct stat statBuf;
-			if (stat(smtpBuf.localFileName, &statBuf) == 0) {
-				ESP_LOGI(TAG, "st_size=%d", (int)statBuf.st_size);
-				if (statBuf.st_size == pictureSize) break;
-				retryCounter++;
-				ESP_LOGI(TAG, "Retry capture %d",retryCounter);
-				if (retryCounter > 10) {
-					ESP_LOGE(TAG, "Retry over for capture");
-					break;
-				}
-				vTaskDelay(1000);
-			}
-		} // end while
+	// Initialize mDNS and advertise the camera
+	int64_t start = esp_timer_get_time();
+	discovery_init();
+	boot_phase("mdns", start);
+
+	/* Create SMTP Client Task */
+	xTaskCreatePinnedToCore(&smtp_client_task, "smtp_client_task", 8*1024, NULL, 5, NULL, NETWORK_CORE);
+
+	/* Create Network Shutter Task */
+#if CONFIG_SHUTTER_TCP
+	xTaskCreatePinnedToCore(tcp_server, "TCP", 1024*4, NULL, 2, NULL, NETWORK_CORE);
+#endif
+
+#if CONFIG_SHUTTER_UDP
+	xTaskCreatePinnedToCore(udp_server, "UDP", 1024*4, NULL, 2, NULL, NETWORK_CORE);
+#endif
+
+#if CONFIG_SHUTTER_MQTT
+	xTaskCreatePinnedToCore(mqtt_client, "MQTT", 1024*4, NULL, 2, NULL, NETWORK_CORE);
+#endif
+}
+
+void app_main(void)
+{
+	boot_phase("app_main", 0);
+	s_boot_group = xEventGroupCreate();
+	configASSERT( s_boot_group );
+
+#if CONFIG_DEEP_SLEEP
+	// Wake cause and the state kept in RTC memory
+	power_init();
+	// The picture is taken before WiFi is started
+	bool network_later = power_woken_by_shutter();
+#else
+	bool network_later = false;
+#endif
+
+	// Initialize NVS
+	int64_t start = esp_timer_get_time();
+	esp_err_t ret = nvs_flash_init();
+	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		ESP_ERROR_CHECK(nvs_flash_erase());
+		ret = nvs_flash_init();
+	}
+	ESP_ERROR_CHECK(ret);
+	boot_phase("nvs", start);
+
+	// The camera events are posted to the default event loop
+	ESP_ERROR_CHECK(esp_event_loop_create_default());
+	wifi_manager_init();
+#if CONFIG_DEEP_SLEEP
+	// Sleep again when all pictures are sent
+	power_start();
+#endif
 
 #if CONFIG_ENABLE_FLASH
-		// Flash Light OFF
-		gpio_set_level(CONFIG_GPIO_FLASH, 0);
+	// Enable Flash Light
+	//gpio_pad_select_gpio(CONFIG_GPIO_FLASH);
+	gpio_reset_pin(CONFIG_GPIO_FLASH);
+	gpio_set_direction(CONFIG_GPIO_FLASH, GPIO_MODE_OUTPUT);
+	gpio_set_level(CONFIG_GPIO_FLASH, 0);
 #endif
 
-		// Send Mail
-		xSemaphoreGive(xSemaphoreSmtp);
-		if (xQueueSend(xQueueSmtp, &smtpBuf, 10) != pdPASS) {
-			ESP_LOGE(TAG, "xQueueSend fail");
-		}
-		xSemaphoreTake(xSemaphoreSmtp, portMAX_DELAY);
+	/* Create Queue */
+	xQueueCmd = xQueueCreate( 1, sizeof(CMD_t) );
+	xQueueSmtp = xQueueCreate( CONFIG_SMTP_BACKLOG, sizeof(SMTP_t) );
+	configASSERT( xQueueCmd );
+	configASSERT( xQueueSmtp );
+
+	/* Initialize trigger aggregator */
+	trigger_init();
 
-	} // end while	
+	/* Create Semaphore */
+	xSemaphoreSmtpDone = xSemaphoreCreateCounting(CONFIG_SMTP_BACKLOG, CONFIG_SMTP_BACKLOG);
+	configASSERT( xSemaphoreSmtpDone );
+
+	/* Register the delivery sinks. The sinks that deliver in their own task come first */
+	sink_register(&smtp_sink);
+#if CONFIG_HTTP_SINK
+	http_sink_init();
+	sink_register(&http_sink);
+#endif
+#if CONFIG_SHUTTER_TCP
+	sink_register(&tcp_sink);
+#endif
+#if CONFIG_MQTT_IMAGE_SINK
+	sink_register(&mqtt_sink);
+#endif
+
+	/* Create Camera Task. The camera is initialized while WiFi connects and SPIFFS is mounted */
+	xTaskCreatePinnedToCore(camera_task, "CAMERA", 1024*8, NULL, 3, NULL, CAPTURE_CORE);
+
+#if CONFIG_REMOTE_IS_VARIABLE_NAME
+	// The clock set before the reset or the deep sleep is kept
+	time_t now;
+	time(&now);
+	if (now > 1600000000) {
+		ESP_LOGI(TAG, "The clock is already set");
+		xEventGroupSetBits(s_boot_group, BOOT_TIME);
+	}
+#else
+	xEventGroupSetBits(s_boot_group, BOOT_TIME);
+#endif
+
+	if (network_later == false) network_start();
+
+	// Initialize SPIFFS
+	ESP_LOGI(TAG, "Initializing SPIFFS");
+	start = esp_timer_get_time();
+	char *partition_label = "storage";
+	char *base_path = "/spiffs";
+	ESP_ERROR_CHECK(mountSPIFFS(partition_label, base_path));
+
+#if CONFIG_STORAGE_ARCHIVE
+	// Initialize image archive
+	ESP_ERROR_CHECK(archive_init());
+#endif
+	boot_phase("storage", start);
+	xEventGroupSetBits(s_boot_group, BOOT_STORAGE);
+
+	/* Create Local Shutter Task */
+#if CONFIG_SHUTTER_ENTER
+	xTaskCreatePinnedToCore(keyin, "KEYIN", 1024*4, NULL, 2, NULL, CAPTURE_CORE);
+#endif
+
+#if CONFIG_SHUTTER_GPIO
+	xTaskCreatePinnedToCore(gpio, "GPIO", 1024*4, NULL, 2, NULL, CAPTURE_CORE);
+#endif
+	boot_phase("shutters", 0);
+
+	if (network_later) {
+		// The GPIO shutter submits the trigger of the wake
+		xEventGroupWaitBits(s_boot_group, BOOT_CAPTURE, pdFALSE, pdTRUE, pdMS_TO_TICKS(5000));
+		network_start();
+	}
 
+	// Show the timeline when all steps are done
+	EventBits_t bits = xEventGroupWaitBits(s_boot_group, BOOT_CAMERA | BOOT_STORAGE | BOOT_NETWORK | BOOT_TIME,
+		pdFALSE, pdTRUE, pdMS_TO_TICKS(60000));
+	if ((bits & BOOT_NETWORK) == 0) ESP_LOGW(TAG, "Boot timeline without network");
+	if ((bits & BOOT_TIME) == 0) ESP_LOGW(TAG, "Boot timeline without time");
+	boot_dump();
 }
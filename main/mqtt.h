@@ -1,9 +1,14 @@
+// Received message. The buffers are taken from a fixed pool.
 typedef struct {
-	TaskHandle_t taskHandle;
-	int32_t event_id;
 	int topic_len;
 	char topic[64];
 	int data_len;
-	char data[64];
+	char data[CONFIG_MQTT_MAX_PAYLOAD + 1];
 } MQTT_t;
 
+// Item of the event queue
+typedef struct {
+	int32_t event_id;
+	MQTT_t *message; // MQTT_EVENT_DATA only. NULL for the other events
+	bool sessionPresent; // MQTT_EVENT_CONNECTED only
+} MQTT_EVENT_t;
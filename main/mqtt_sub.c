@@ -1,5 +1,15 @@
 /*	MQTT (over TCP) Example
 
+	The payload of the subscribe topic is a capture request in one of these formats.
+	JSON:   {"id":"req-1","framesize":"VGA","quality":10,"flash":true,"burst":3,"interval":500,"to":["a@example.com"]}
+	Binary: 0xB1, id(4), framesize(1), quality(1), flash(1), burst(1), interval(2), recipients(n)
+	        Multi-byte values are big endian. 0xff is the configured value.
+	Text:   framesize=VGA quality=10 flash=on to=a@example.com
+	The status of each trigger is published to the status topic in JSON.
+	The image sink publishes the picture in chunks to this topic tree.
+	  IMAGE_TOPIC/CLIENT_ID/TRIGGER_ID/chunk/N  raw JPEG data of chunk N
+	  IMAGE_TOPIC/CLIENT_ID/TRIGGER_ID/manifest JSON published after the last chunk
+
 	This example code is in the Public Domain (or CC0 licensed, at your option.)
 
 	Unless required by applicable law or agreed to in writing, this
@@ -10,6 +20,8 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -19,29 +31,115 @@
 #include "lwip/dns.h"
 #include "esp_mac.h"
 #include "mqtt_client.h"
-#include "mdns.h"
+#include "esp_camera.h"
+#include "cJSON.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "freertos/semphr.h"
 
 #include "cmd.h"
+#include "trigger.h"
 #include "mqtt.h"
-
-extern QueueHandle_t xQueueCmd;
+#include "discovery.h"
+#include "sink.h"
+#include "wifi_manager.h"
 
 static const char *TAG = "MQTT";
 
+#define BINARY_MAGIC 0xB1
+#define BINARY_HEADER_SIZE 11
+#define MAX_BURST 10
+#define MAX_REQUESTS 4 // Requests running at the same time
+#define MAX_STATUS 16 // Triggers waiting for the result
+#define REQUEST_ID_SIZE 32
+
+typedef struct {
+	char id[REQUEST_ID_SIZE];
+	CMD_t cmd;
+	int count; // Triggers left
+	int index; // Index of the next trigger in the burst
+	int interval; // Milliseconds
+	int64_t next;
+	int64_t received;
+	bool active;
+} REQUEST_t;
+
+typedef struct {
+	uint32_t trigger;
+	char request[REQUEST_ID_SIZE];
+	int index;
+	bool valid;
+} STATUS_t;
+
+static esp_mqtt_client_handle_t s_client;
+static char s_client_id[64];
+static REQUEST_t s_request[MAX_REQUESTS];
+static STATUS_t s_status[MAX_STATUS];
+static SemaphoreHandle_t s_mutex;
+static uint32_t s_request_seq;
+static volatile bool s_connected;
+
+/*
+ * The events are passed to the task through one queue, so the order of CONNECTED and DATA is kept.
+ * The queue has room for the control events even when all the message buffers are in the queue.
+ * This handler runs in the MQTT client task, so it never waits.
+ */
+#define POOL_SIZE CONFIG_MQTT_POOL_SIZE
+#define EVENT_QUEUE_SIZE (POOL_SIZE + 4)
+
+static MQTT_t s_pool[POOL_SIZE];
+static QueueHandle_t xQueueMqttFree;
+static QueueHandle_t xQueueMqttEvent;
+
+typedef struct {
+	uint32_t messages;
+	uint32_t fragmented;
+	uint32_t noBuffer; // No free buffer in the pool
+	uint32_t tooLarge; // Larger than CONFIG_MQTT_MAX_PAYLOAD
+	uint32_t queueFull;
+} MQTT_STATS_t;
+
+static MQTT_STATS_t s_mqtt_stats;
+
+typedef struct {
+	uint32_t reconnects;
+	uint32_t disconnects;
+	uint32_t errors;
+	int64_t disconnected; // Time of the disconnection. 0 while connected
+	int64_t outageLast;
+	int64_t outageMax;
+	int64_t outageTotal;
+} CONNECTION_STATS_t;
+
+static void queue_event(int32_t event_id, MQTT_t *message, bool sessionPresent)
+{
+	MQTT_EVENT_t item = { event_id, message, sessionPresent };
+	if (xQueueSend(xQueueMqttEvent, &item, 0) != pdPASS) {
+		s_mqtt_stats.queueFull++;
+		ESP_LOGE(TAG, "Event queue full. event_id=%"PRIi32, event_id);
+		if (message) xQueueSend(xQueueMqttFree, &message, 0);
+	}
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
 	esp_mqtt_event_handle_t event = event_data;
-	MQTT_t *mqttBuf = handler_args;
-	ESP_LOGD(TAG, "taskHandle=0x%x", (unsigned int)mqttBuf->taskHandle);
-	mqttBuf->event_id = event->event_id;
+	// Message being reassembled from the fragments
+	static MQTT_t *assembling = NULL;
+	static bool skipping = false;
+
 	switch (event->event_id) {
 		case MQTT_EVENT_CONNECTED:
-			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-			xTaskNotifyGive( mqttBuf->taskHandle );
+			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED session_present=%d", event->session_present);
+			queue_event(event->event_id, NULL, event->session_present);
 			break;
 		case MQTT_EVENT_DISCONNECTED:
 			ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-			xTaskNotifyGive( mqttBuf->taskHandle );
+			// The rest of the fragmented message will not come
+			if (assembling) xQueueSend(xQueueMqttFree, &assembling, 0);
+			assembling = NULL;
+			skipping = false;
+			queue_event(event->event_id, NULL, false);
 			break;
 		case MQTT_EVENT_SUBSCRIBED:
 			ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -50,27 +148,58 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 			ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_PUBLISHED:
-			ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_DATA:
-			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-			ESP_LOGI(TAG, "TOPIC=[%.*s] DATA=[%.*s]\r", event->topic_len, event->topic, event->data_len, event->data);
-
-			mqttBuf->topic_len = event->topic_len;
-			for(int i=0;i<event->topic_len;i++) {
-				mqttBuf->topic[i] = event->topic[i];
-				mqttBuf->topic[i+1] = 0;
+			ESP_LOGI(TAG, "MQTT_EVENT_DATA offset=%d len=%d total=%d", event->current_data_offset, event->data_len, event->total_data_len);
+			if (event->current_data_offset == 0) {
+				// The first fragment has the topic
+				if (assembling) xQueueSend(xQueueMqttFree, &assembling, 0);
+				assembling = NULL;
+				skipping = false;
+				s_mqtt_stats.messages++;
+				if (event->data_len != event->total_data_len) s_mqtt_stats.fragmented++;
+				if (event->total_data_len > CONFIG_MQTT_MAX_PAYLOAD) {
+					s_mqtt_stats.tooLarge++;
+					ESP_LOGW(TAG, "Message of %d bytes is too large. tooLarge=%"PRIu32, event->total_data_len, s_mqtt_stats.tooLarge);
+					skipping = true;
+					break;
+				}
+				if (xQueueReceive(xQueueMqttFree, &assembling, 0) != pdPASS) {
+					s_mqtt_stats.noBuffer++;
+					ESP_LOGW(TAG, "No buffer for the message. noBuffer=%"PRIu32, s_mqtt_stats.noBuffer);
+					assembling = NULL;
+					skipping = true;
+					break;
+				}
+				assembling->topic_len = (event->topic_len < sizeof(assembling->topic)) ? event->topic_len : sizeof(assembling->topic) - 1;
+				memcpy(assembling->topic, event->topic, assembling->topic_len);
+				assembling->topic[assembling->topic_len] = 0;
+				assembling->data_len = event->total_data_len;
+			}
+			if (skipping || assembling == NULL) break;
+			if (event->current_data_offset + event->data_len > assembling->data_len) {
+				ESP_LOGE(TAG, "Fragment out of range");
+				xQueueSend(xQueueMqttFree, &assembling, 0);
+				assembling = NULL;
+				break;
 			}
-			mqttBuf->data_len = event->data_len;
-			for(int i=0;i<event->data_len;i++) {
-				mqttBuf->data[i] = event->data[i];
-				mqttBuf->data[i+1] = 0;
+			// The binary payload may have 0
+			memcpy(assembling->data + event->current_data_offset, event->data, event->data_len);
+			if (event->current_data_offset + event->data_len == assembling->data_len) {
+				assembling->data[assembling->data_len] = 0;
+				queue_event(event->event_id, assembling, false);
+				assembling = NULL;
 			}
-			xTaskNotifyGive( mqttBuf->taskHandle );
 			break;
 		case MQTT_EVENT_ERROR:
 			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
-			xTaskNotifyGive( mqttBuf->taskHandle );
+			if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+				ESP_LOGW(TAG, "transport error 0x%x errno=%d", event->error_handle->esp_tls_last_esp_err, event->error_handle->esp_transport_sock_errno);
+			} else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+				ESP_LOGW(TAG, "connection refused 0x%x", event->error_handle->connect_return_code);
+			}
+			queue_event(event->event_id, NULL, false);
 			break;
 		default:
 			ESP_LOGI(TAG, "Other event id:%d", event->event_id);
@@ -79,52 +208,334 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 	return;
 }
 
-esp_err_t query_mdns_host(const char * host_name, char *ip)
+// Publish the status of the trigger to the status topic
+static void publish_status(const char *request, int index, uint32_t trigger, const char *status, int64_t elapsed)
 {
-	ESP_LOGD(__FUNCTION__, "Query A: %s", host_name);
+	char payload[256];
+	int len = snprintf(payload, sizeof(payload),
+		"{\"camera\":\"%s\",\"request\":\"%s\",\"index\":%d,\"trigger\":%"PRIu32",\"status\":\"%s\",\"elapsed_us\":%"PRIi64"}",
+		s_client_id, request, index, trigger, status, elapsed);
+	ESP_LOGI(TAG, "%s", payload);
+	// Not blocking, because this is also called in the event loop task
+	if (esp_mqtt_client_enqueue(s_client, CONFIG_MQTT_PUB_TOPIC, payload, len, 1, 0, true) < 0) {
+		ESP_LOGW(TAG, "Status of %s is not published", request);
+	}
+}
 
-	struct esp_ip4_addr addr;
-	addr.addr = 0;
+static void publish_overrun(MQTT_STATS_t *stats)
+{
+	char payload[192];
+	int len = snprintf(payload, sizeof(payload),
+		"{\"camera\":\"%s\",\"status\":\"overrun\",\"messages\":%"PRIu32",\"fragmented\":%"PRIu32",\"no_buffer\":%"PRIu32",\"too_large\":%"PRIu32",\"queue_full\":%"PRIu32"}",
+		s_client_id, stats->messages, stats->fragmented, stats->noBuffer, stats->tooLarge, stats->queueFull);
+	ESP_LOGW(TAG, "%s", payload);
+	esp_mqtt_client_enqueue(s_client, CONFIG_MQTT_PUB_TOPIC, payload, len, 1, 0, true);
+}
 
-	esp_err_t err = mdns_query_a(host_name, 10000,	&addr);
-	if(err){
-		if(err == ESP_ERR_NOT_FOUND){
-			ESP_LOGW(__FUNCTION__, "%s: Host was not found!", host_name);
-		} else {
-			ESP_LOGE(__FUNCTION__, "Query Failed: %s", esp_err_to_name(err));
+static void publish_reconnect(CONNECTION_STATS_t *stats, bool sessionPresent)
+{
+	char payload[256];
+	int len = snprintf(payload, sizeof(payload),
+		"{\"camera\":\"%s\",\"status\":\"reconnected\",\"session_present\":%s,\"reconnects\":%"PRIu32",\"disconnects\":%"PRIu32",\"errors\":%"PRIu32
+		",\"outage_us\":%"PRIi64",\"outage_max_us\":%"PRIi64",\"outage_total_us\":%"PRIi64"}",
+		s_client_id, sessionPresent ? "true" : "false", stats->reconnects, stats->disconnects, stats->errors,
+		stats->outageLast, stats->outageMax, stats->outageTotal);
+	ESP_LOGI(TAG, "%s", payload);
+	esp_mqtt_client_enqueue(s_client, CONFIG_MQTT_PUB_TOPIC, payload, len, 1, 0, true);
+}
+
+static void camera_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+	static const char *names[] = {"captured", "sent", "failed", "suppressed", "cancelled"};
+	CAMERA_EVENT_t *event = (CAMERA_EVENT_t *)event_data;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	// Coalesced triggers have the same id
+	for (int i=0; i<MAX_STATUS; i++) {
+		STATUS_t *status = &s_status[i];
+		if (status->valid == false || status->trigger != event->id) continue;
+		publish_status(status->request, status->index, status->trigger, names[event_id], event->elapsed);
+		if (event_id != CAMERA_EVENT_CAPTURED) status->valid = false;
+	}
+	xSemaphoreGive(s_mutex);
+}
+
+// Call with s_mutex taken
+static void status_add(REQUEST_t *request, uint32_t trigger)
+{
+	STATUS_t *status = NULL;
+	for (int i=0; i<MAX_STATUS; i++) {
+		if (s_status[i].valid == false) {
+			status = &s_status[i];
+			break;
 		}
+	}
+	if (status == NULL) {
+		ESP_LOGW(TAG, "Too many triggers waiting for the result. The result of %s is not published", request->id);
+	} else {
+		status->valid = true;
+		status->trigger = trigger;
+		status->index = request->index;
+		strcpy(status->request, request->id);
+	}
+}
+
+static bool valid_request_id(const char *id)
+{
+	if (strlen(id) == 0 || strlen(id) >= REQUEST_ID_SIZE) return false;
+	// The id is written in JSON as it is
+	for (const char *p = id; *p; p++) {
+		if (isalnum((unsigned char)*p) == 0 && strchr("-_.:", *p) == NULL) return false;
+	}
+	return true;
+}
+
+// Append to the text without overflow. Returns false when the text does not fit
+static bool append(char *text, size_t size, int *len, const char *format, ...)
+{
+	if (*len < 0 || (size_t)*len >= size) return false;
+	va_list args;
+	va_start(args, format);
+	int ret = vsnprintf(text + *len, size - *len, format, args);
+	va_end(args);
+	if (ret < 0 || (size_t)ret >= size - *len) {
+		*len = size;
+		return false;
+	}
+	*len += ret;
+	return true;
+}
+
+static esp_err_t parse_json(MQTT_t *mqttBuf, REQUEST_t *request)
+{
+	cJSON *root = cJSON_ParseWithLength(mqttBuf->data, mqttBuf->data_len);
+	if (root == NULL) {
+		ESP_LOGW(TAG, "JSON parse error");
 		return ESP_FAIL;
 	}
+	esp_err_t ret = ESP_FAIL;
+	// The parameters are converted to the text of cmd_parse_params
+	char params[160];
+	int len = 0;
+	params[0] = 0;
+	cJSON *item = cJSON_GetObjectItem(root, "id");
+	if (cJSON_IsString(item)) {
+		snprintf(request->id, REQUEST_ID_SIZE, "%s", item->valuestring);
+	} else if (cJSON_IsNumber(item)) {
+		snprintf(request->id, REQUEST_ID_SIZE, "%d", item->valueint);
+	}
+	item = cJSON_GetObjectItem(root, "framesize");
+	if (cJSON_IsString(item) && append(params, sizeof(params), &len, "framesize=%s ", item->valuestring) == false) goto exit;
+	item = cJSON_GetObjectItem(root, "quality");
+	if (cJSON_IsNumber(item) && append(params, sizeof(params), &len, "quality=%d ", item->valueint) == false) goto exit;
+	item = cJSON_GetObjectItem(root, "flash");
+	if (cJSON_IsBool(item) || cJSON_IsNumber(item)) {
+		bool flash = cJSON_IsBool(item) ? cJSON_IsTrue(item) : (item->valueint != 0);
+		if (append(params, sizeof(params), &len, "flash=%s ", flash ? "on" : "off") == false) goto exit;
+	}
+	item = cJSON_GetObjectItem(root, "burst");
+	if (cJSON_IsNumber(item)) request->count = item->valueint;
+	item = cJSON_GetObjectItem(root, "interval");
+	if (cJSON_IsNumber(item)) request->interval = item->valueint;
+	item = cJSON_GetObjectItem(root, "to");
+	if (cJSON_IsString(item)) {
+		if (append(params, sizeof(params), &len, "to=%s", item->valuestring) == false) goto exit;
+	} else if (cJSON_IsArray(item)) {
+		if (append(params, sizeof(params), &len, "to=") == false) goto exit;
+		cJSON *to;
+		cJSON_ArrayForEach(to, item) {
+			if (cJSON_IsString(to) == false) goto exit;
+			if (append(params, sizeof(params), &len, "%s%s", to->valuestring, to->next ? "," : "") == false) goto exit;
+		}
+	}
+	ESP_LOGI(TAG, "params=[%s]", params);
+	if (cmd_parse_params(params, &request->cmd) < 0) goto exit;
+	ret = ESP_OK;
 
-	ESP_LOGD(__FUNCTION__, "Query A: %s.local resolved to: " IPSTR, host_name, IP2STR(&addr));
-	sprintf(ip, IPSTR, IP2STR(&addr));
+exit:
+	cJSON_Delete(root);
+	return ret;
+}
+
+static esp_err_t parse_binary(MQTT_t *mqttBuf, REQUEST_t *request)
+{
+	uint8_t *data = (uint8_t *)mqttBuf->data;
+	if (mqttBuf->data_len < BINARY_HEADER_SIZE) return ESP_FAIL;
+	uint32_t id = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+	snprintf(request->id, REQUEST_ID_SIZE, "%"PRIu32, id);
+	if (data[5] != PARAM_DEFAULT && data[5] > FRAMESIZE_UXGA) return ESP_FAIL;
+	if (data[6] != PARAM_DEFAULT && data[6] > 63) return ESP_FAIL;
+	request->cmd.framesize = data[5];
+	request->cmd.quality = data[6];
+	request->cmd.flash = (data[7] == PARAM_DEFAULT) ? PARAM_DEFAULT : (data[7] != 0);
+	if (data[8]) request->count = data[8];
+	request->interval = (data[9] << 8) | data[10];
+	int toLen = mqttBuf->data_len - BINARY_HEADER_SIZE;
+	if (toLen) {
+		char params[RECIPIENTS_SIZE + 4];
+		if (toLen >= RECIPIENTS_SIZE) return ESP_FAIL;
+		sprintf(params, "to=%.*s", toLen, (char *)&data[BINARY_HEADER_SIZE]);
+		if (cmd_parse_params(params, &request->cmd) < 0) return ESP_FAIL;
+	}
 	return ESP_OK;
 }
 
-void convert_mdns_host(char * from, char * to)
+static void handle_request(MQTT_t *mqttBuf)
+{
+	REQUEST_t request;
+	memset(&request, 0, sizeof(request));
+	cmd_init(&request.cmd, CMD_TAKE, SOURCE_MQTT);
+	request.count = 1;
+	request.received = esp_timer_get_time();
+	esp_err_t ret;
+	if (mqttBuf->data[0] == '{') {
+		ret = parse_json(mqttBuf, &request);
+	} else if ((uint8_t)mqttBuf->data[0] == BINARY_MAGIC) {
+		ret = parse_binary(mqttBuf, &request);
+	} else {
+		ret = (cmd_parse_params(mqttBuf->data, &request.cmd) < 0) ? ESP_FAIL : ESP_OK;
+	}
+	if (strlen(request.id) == 0) sprintf(request.id, "%"PRIu32, ++s_request_seq);
+	if (valid_request_id(request.id) == false) {
+		ESP_LOGW(TAG, "Invalid request id");
+		strcpy(request.id, "invalid");
+		ret = ESP_FAIL;
+	}
+	if (request.count < 1 || request.count > MAX_BURST || request.interval < 0) {
+		ESP_LOGW(TAG, "burst must be 1 to %d", MAX_BURST);
+		ret = ESP_FAIL;
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "Invalid request");
+		publish_status(request.id, 0, 0, "invalid", 0);
+		return;
+	}
+	// Each trigger of a burst asks for a picture of its own, even with a short interval
+	request.cmd.burst = (request.count > 1);
+	for (int i=0; i<MAX_REQUESTS; i++) {
+		if (s_request[i].active) continue;
+		s_request[i] = request;
+		s_request[i].active = true;
+		s_request[i].next = request.received;
+		return;
+	}
+	ESP_LOGW(TAG, "Too many requests");
+	publish_status(request.id, 0, 0, "busy", 0);
+}
+
+// Submit the triggers that are due, and return the ticks until the next trigger
+static TickType_t run_requests(void)
 {
-	ESP_LOGI(__FUNCTION__, "from=[%s]",from);
-	strcpy(to, from);
-	char *sp;
-	sp = strstr(from, ".local");
-	if (sp == NULL) return;
+	static const char *names[] = {"queued", "coalesced", "dropped"};
+	int64_t now = esp_timer_get_time();
+	int64_t wait = -1;
+	for (int i=0; i<MAX_REQUESTS; i++) {
+		REQUEST_t *request = &s_request[i];
+		if (request->active == false) continue;
+		if (request->next <= now) {
+			CMD_t cmd = request->cmd;
+			// The status of the capture is published after the status of the submit
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			TRIGGER_RESULT result = trigger_submit(&cmd);
+			if (result != TRIGGER_DROPPED) status_add(request, cmd.id);
+			publish_status(request->id, request->index, cmd.id, names[result], now - request->received);
+			xSemaphoreGive(s_mutex);
+			request->index++;
+			request->next = now + request->interval * 1000LL;
+			if (--request->count == 0) {
+				request->active = false;
+				continue;
+			}
+		}
+		int64_t remain = request->next - now;
+		if (wait < 0 || remain < wait) wait = remain;
+	}
+	if (wait < 0) return portMAX_DELAY;
+	return pdMS_TO_TICKS(wait / 1000) + 1;
+}
+
+#if CONFIG_MQTT_IMAGE_SINK
+static SINK_STATS_t s_sink_stats;
+
+// Wait until the outbox has room for the chunk
+static bool wait_outbox(int64_t deadline)
+{
+	while (esp_mqtt_client_get_outbox_size(s_client) > CONFIG_MQTT_IMAGE_OUTBOX) {
+		if (s_connected == false || esp_timer_get_time() > deadline) return false;
+		vTaskDelay(1);
+	}
+	return true;
+}
 
-	int _len = sp - from;
-	ESP_LOGD(__FUNCTION__, "_len=%d", _len);
-	char _from[128];
-	strcpy(_from, from);
-	_from[_len] = 0;
-	ESP_LOGI(__FUNCTION__, "_from=[%s]", _from);
+/*
+ * Called in the camera task while the mail is being sent.
+ * The frame buffer is published in QoS 1 chunks, then the manifest is published.
+ * The broker delivers them in order, so the consumer has all chunks when the manifest arrives.
+ */
+static esp_err_t mqtt_frame_publish(camera_fb_t *fb, uint32_t id)
+{
+	if (s_client == NULL || s_connected == false) {
+		ESP_LOGW(TAG, "Not connected. The picture is not published");
+		return ESP_ERR_INVALID_STATE;
+	}
+	int64_t start = esp_timer_get_time();
+	int64_t deadline = start + CONFIG_MQTT_IMAGE_TIMEOUT * 1000000LL;
+	char topic[128];
+	int chunks = (fb->len + CONFIG_MQTT_IMAGE_CHUNK_SIZE - 1) / CONFIG_MQTT_IMAGE_CHUNK_SIZE;
+	for (int i=0; i<chunks; i++) {
+		size_t offset = i * CONFIG_MQTT_IMAGE_CHUNK_SIZE;
+		size_t len = fb->len - offset;
+		if (len > CONFIG_MQTT_IMAGE_CHUNK_SIZE) len = CONFIG_MQTT_IMAGE_CHUNK_SIZE;
+		if (wait_outbox(deadline) == false) {
+			ESP_LOGE(TAG, "Chunk %d/%d of %"PRIu32" is not published", i, chunks, id);
+			return ESP_ERR_TIMEOUT;
+		}
+		snprintf(topic, sizeof(topic), "%s/%s/%"PRIu32"/chunk/%d", CONFIG_MQTT_IMAGE_TOPIC, s_client_id, id, i);
+		if (esp_mqtt_client_publish(s_client, topic, (const char *)fb->buf + offset, len, 1, 0) < 0) {
+			ESP_LOGE(TAG, "esp_mqtt_client_publish fail %s", topic);
+			return ESP_FAIL;
+		}
+	}
+	char manifest[256];
+	int len = snprintf(manifest, sizeof(manifest),
+		"{\"camera\":\"%s\",\"trigger\":%"PRIu32",\"size\":%d,\"chunks\":%d,\"chunk_size\":%d,\"width\":%d,\"height\":%d,\"crc32\":%"PRIu32"}",
+		s_client_id, id, fb->len, chunks, CONFIG_MQTT_IMAGE_CHUNK_SIZE, fb->width, fb->height, esp_rom_crc32_le(0, fb->buf, fb->len));
+	snprintf(topic, sizeof(topic), "%s/%s/%"PRIu32"/manifest", CONFIG_MQTT_IMAGE_TOPIC, s_client_id, id);
+	if (esp_mqtt_client_publish(s_client, topic, manifest, len, 1, 0) < 0) {
+		ESP_LOGE(TAG, "esp_mqtt_client_publish fail %s", topic);
+		return ESP_FAIL;
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	ESP_LOGI(TAG, "Published %d bytes in %d chunks in %"PRIi64"us (%"PRIi64" KB/s)",
+		fb->len, chunks, elapsed, (elapsed == 0) ? 0 : ((int64_t)fb->len * 1000000 / elapsed) / 1024);
+	return ESP_OK;
+}
 
-	char _ip[128];
-	esp_err_t ret = query_mdns_host(_from, _ip);
-	ESP_LOGI(__FUNCTION__, "query_mdns_host=%d _ip=[%s]", ret, _ip);
-	if (ret != ESP_OK) return;
+// The suppressed picture is not published
+static esp_err_t mqtt_sink_submit(SINK_FRAME_t *frame)
+{
+	if (frame->suppressed || frame->fb == NULL) {
+		sink_stats_update(&s_sink_stats, ESP_ERR_NOT_SUPPORTED, 0, 0);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	esp_err_t ret = mqtt_frame_publish(frame->fb, frame->info.triggerId);
+	sink_stats_update(&s_sink_stats, ret, frame->fb->len, frame->info.triggerTime);
+	return ret;
+}
 
-	strcpy(to, _ip);
-	ESP_LOGI(__FUNCTION__, "to=[%s]", to);
+static void mqtt_sink_stats(SINK_STATS_t *stats)
+{
+	*stats = s_sink_stats;
 }
 
+const SINK_t mqtt_sink = {
+	.name = "MQTT",
+	.usesFrameBuffer = true,
+	.submit = mqtt_sink_submit,
+	.flush = NULL,
+	.stats = mqtt_sink_stats,
+};
+#endif
+
 void mqtt_client(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start");
@@ -136,23 +547,33 @@ void mqtt_client(void *pvParameters)
 	for(int i=0;i<8;i++) {
 		ESP_LOGI(TAG, "mac[%d]=%x", i, mac[i]);
 	}
-	char client_id[64];
+	char *client_id = s_client_id;
 	sprintf(client_id, "esp32-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
 	ESP_LOGI(TAG, "client_id=[%s]", client_id);
 
+	// The broker can not be resolved before the station has the address
+	wifi_manager_wait(portMAX_DELAY);
+
 	// Resolve mDNS host name
 	char ip[128];
-	ESP_LOGI(TAG, "CONFIG_MQTT_BROKER=[%s]", CONFIG_MQTT_BROKER);
-	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
+	discovery_resolve(CONFIG_MQTT_BROKER, ip, sizeof(ip));
 	ESP_LOGI(TAG, "ip=[%s]", ip);
 	char uri[138];
 	sprintf(uri, "mqtt://%s", ip);
 	ESP_LOGI(TAG, "uri=[%s]", uri);
 
+	// Pool of the message buffers
+	xQueueMqttFree = xQueueCreate(POOL_SIZE, sizeof(MQTT_t *));
+	configASSERT( xQueueMqttFree );
+	xQueueMqttEvent = xQueueCreate(EVENT_QUEUE_SIZE, sizeof(MQTT_EVENT_t));
+	configASSERT( xQueueMqttEvent );
+	for (int i=0; i<POOL_SIZE; i++) {
+		MQTT_t *message = &s_pool[i];
+		xQueueSend(xQueueMqttFree, &message, 0);
+	}
+	ESP_LOGI(TAG, "pool=%d max payload=%d", POOL_SIZE, CONFIG_MQTT_MAX_PAYLOAD);
+
 	// Initialize MQTT Connection
-	MQTT_t mqttBuf;
-	mqttBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	ESP_LOGI(TAG, "taskHandle=0x%x", (unsigned int)mqttBuf.taskHandle);
 	esp_mqtt_client_config_t mqtt_cfg = {
 		.broker.address.uri = uri,
 		.broker.address.port = 1883,
@@ -160,39 +581,81 @@ void mqtt_client(void *pvParameters)
 		.credentials.username = CONFIG_AUTHENTICATION_USERNAME,
 		.credentials.authentication.password = CONFIG_AUTHENTICATION_PASSWORD,
 #endif
-		.credentials.client_id = client_id
+		.credentials.client_id = client_id,
+		// The broker keeps the subscription and the QoS 1 messages while disconnected
+		.session.disable_clean_session = true,
+		.session.keepalive = CONFIG_MQTT_KEEPALIVE,
+		.network.reconnect_timeout_ms = CONFIG_MQTT_RECONNECT_TIMEOUT * 1000,
 	};
 
 	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, &mqttBuf);
+	s_client = mqtt_client;
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	ESP_ERROR_CHECK(esp_event_handler_register(CAMERA_EVENT, ESP_EVENT_ANY_ID, camera_event_handler, NULL));
+	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
 	esp_mqtt_client_start(mqtt_client);
 
-	CMD_t cmdBuf;
-	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
-
+	TickType_t wait = portMAX_DELAY;
+	uint32_t overruns = 0;
+	CONNECTION_STATS_t connection;
+	memset(&connection, 0, sizeof(connection));
+	MQTT_EVENT_t item;
 	while (1) {
-		ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
-		ESP_LOGI(TAG, "ulTaskNotifyTake");
-		ESP_LOGI(TAG, "event_id=%"PRIi32, mqttBuf.event_id);
-
-		if (mqttBuf.event_id == MQTT_EVENT_CONNECTED) {
-			esp_mqtt_client_subscribe(mqtt_client, CONFIG_MQTT_SUB_TOPIC, 0);
-			ESP_LOGI(TAG, "Subscribe to MQTT Server");
-		} else if (mqttBuf.event_id == MQTT_EVENT_DISCONNECTED) {
-			break;
-		} else if (mqttBuf.event_id == MQTT_EVENT_DATA) {
-			ESP_LOGI(TAG, "TOPIC=[%.*s]\r", mqttBuf.topic_len, mqttBuf.topic);
-			ESP_LOGI(TAG, "DATA=[%.*s]\r", mqttBuf.data_len, mqttBuf.data);
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
+		// Wake up for the event or the next trigger of the burst
+		if (xQueueReceive(xQueueMqttEvent, &item, wait) != pdPASS) {
+			wait = run_requests();
+			continue;
+		}
+		ESP_LOGI(TAG, "event_id=%"PRIi32, item.event_id);
+
+		if (item.event_id == MQTT_EVENT_CONNECTED) {
+			s_connected = true;
+			// Subscribe again, because the broker may have lost the session
+			esp_mqtt_client_subscribe(mqtt_client, CONFIG_MQTT_SUB_TOPIC, 1);
+			ESP_LOGI(TAG, "Subscribe to MQTT Server session_present=%d", item.sessionPresent);
+			if (connection.disconnected) {
+				int64_t outage = esp_timer_get_time() - connection.disconnected;
+				connection.disconnected = 0;
+				connection.reconnects++;
+				connection.outageLast = outage;
+				connection.outageTotal += outage;
+				if (outage > connection.outageMax) connection.outageMax = outage;
+				publish_reconnect(&connection, item.sessionPresent);
 			}
-		} else if (mqttBuf.event_id == MQTT_EVENT_ERROR) {
-			break;
+		} else if (item.event_id == MQTT_EVENT_DISCONNECTED) {
+			// The client reconnects by itself
+			s_connected = false;
+			if (connection.disconnected == 0) connection.disconnected = esp_timer_get_time();
+			connection.disconnects++;
+			// The broker may have moved to another address
+			char address[128];
+			if (discovery_resolve(CONFIG_MQTT_BROKER, address, sizeof(address)) == ESP_OK && strcmp(address, ip) != 0) {
+				ESP_LOGW(TAG, "Broker moved from %s to %s", ip, address);
+				strcpy(ip, address);
+				sprintf(uri, "mqtt://%s", ip);
+				esp_mqtt_client_set_uri(mqtt_client, uri);
+			}
+		} else if (item.event_id == MQTT_EVENT_DATA) {
+			MQTT_t *message = item.message;
+			ESP_LOGI(TAG, "TOPIC=[%.*s]\r", message->topic_len, message->topic);
+			ESP_LOGI(TAG, "DATA=[%.*s]\r", message->data_len, message->data);
+			handle_request(message);
+			xQueueSend(xQueueMqttFree, &message, 0);
+		} else if (item.event_id == MQTT_EVENT_ERROR) {
+			connection.errors++;
+		}
+
+		// Report the messages lost since the last report
+		MQTT_STATS_t stats = s_mqtt_stats;
+		if (stats.noBuffer + stats.tooLarge + stats.queueFull != overruns) {
+			overruns = stats.noBuffer + stats.tooLarge + stats.queueFull;
+			publish_overrun(&stats);
 		}
+		wait = run_requests();
 	} // end while
 
-	ESP_LOGI(TAG, "Task Delete");
+	/* Never reach */
 	esp_mqtt_client_stop(mqtt_client);
 	vTaskDelete(NULL);
 
@@ -0,0 +1,68 @@
+/* Perceptual hash of JPEG picture
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "preview.h"
+
+static const char *TAG = "PHASH";
+
+#define HASH_GRID 8
+
+/*
+ * Average hash of the luma plane.
+ * The picture decoded at 1/8 scale is shared with the thumbnail.
+ */
+esp_err_t phash_compute(const PREVIEW_t *preview, uint64_t *hash)
+{
+	int64_t start = esp_timer_get_time();
+	if (preview->rgb == NULL) return ESP_ERR_INVALID_ARG;
+
+	// Accumulate the luma of every pixel into a 8x8 grid
+	uint32_t sum[HASH_GRID*HASH_GRID];
+	uint32_t count[HASH_GRID*HASH_GRID];
+	memset(sum, 0, sizeof(sum));
+	memset(count, 0, sizeof(count));
+	for (int y=0; y<preview->height; y++) {
+		int gy = (y * HASH_GRID) / preview->height;
+		for (int x=0; x<preview->width; x++) {
+			int gx = (x * HASH_GRID) / preview->width;
+			const uint8_t *p = preview->rgb + (y * preview->width + x) * 3;
+			// p[0] is B and p[2] is R
+			uint32_t luma = (29 * p[0] + 150 * p[1] + 77 * p[2]) >> 8;
+			sum[gy * HASH_GRID + gx] += luma;
+			count[gy * HASH_GRID + gx]++;
+		}
+	}
+
+	uint32_t mean[HASH_GRID*HASH_GRID];
+	uint32_t total = 0;
+	for (int i=0; i<HASH_GRID*HASH_GRID; i++) {
+		mean[i] = (count[i] == 0) ? 0 : sum[i] / count[i];
+		total += mean[i];
+	}
+	total = total / (HASH_GRID*HASH_GRID);
+
+	uint64_t _hash = 0;
+	for (int i=0; i<HASH_GRID*HASH_GRID; i++) {
+		if (mean[i] > total) _hash |= (1ULL << i);
+	}
+	*hash = _hash;
+	ESP_LOGI(TAG, "hash=%016"PRIx64" scaled=%dx%d elapsed=%"PRIi64"us",
+		_hash, preview->width, preview->height, esp_timer_get_time() - start);
+	return ESP_OK;
+}
+
+int phash_distance(uint64_t a, uint64_t b)
+{
+	return __builtin_popcountll(a ^ b);
+}
@@ -0,0 +1,260 @@
+/* Deep sleep between the pictures
+
+	The chip sleeps with the ext0 wake on the shutter GPIO.
+	On wake the picture is taken first, and WiFi is started after the capture.
+	When every picture has been delivered by all the sinks and nothing happens for SLEEP_IDLE_TIME, the chip sleeps again.
+
+	The latency is measured from the reset, because the clock stops in deep sleep.
+	The time of the ROM and the bootloader is not included.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "driver/rtc_io.h"
+
+#include "esp_camera.h"
+#include "cmd.h"
+#include "camera_pin.h"
+#include "sink.h"
+#include "power.h"
+
+static const char *TAG = "POWER";
+
+#define RTC_MAGIC 0x534C5032 // SLP2
+
+// Kept while in deep sleep
+typedef struct {
+	uint32_t magic;
+	uint32_t wakes;
+	uint32_t shutterWakes;
+	uint32_t captured;
+	uint32_t sent;
+	uint32_t failed;
+	uint32_t timeouts;
+	int64_t captureSum;
+	int64_t captureMax;
+	uint32_t sentSamples; // Shutter wakes with the time to the first mail
+	int64_t sentSum;
+	int64_t sentMax;
+	int64_t awakeSum;
+#if CONFIG_SLEEP_SELFTEST
+	uint32_t selftestPass;
+	uint32_t selftestFail;
+#endif
+} POWER_STATE_t;
+
+RTC_DATA_ATTR static POWER_STATE_t s_state;
+
+static esp_sleep_wakeup_cause_t s_cause;
+static volatile int32_t s_pending = 0; // Captured but not sent yet
+static volatile int64_t s_activity = 0; // Time of the last event
+static int64_t s_wake_to_capture = 0;
+static int64_t s_wake_to_sent = 0;
+static bool s_wake_failed = false;
+
+#if CONFIG_GPIO_PULLUP
+#define WAKE_LEVEL 0
+#else
+#define WAKE_LEVEL 1
+#endif
+
+// Called first in app_main
+void power_init(void)
+{
+	s_cause = esp_sleep_get_wakeup_cause();
+	if (s_state.magic != RTC_MAGIC) {
+		memset(&s_state, 0, sizeof(s_state));
+		s_state.magic = RTC_MAGIC;
+	}
+	s_state.wakes++;
+	if (s_cause == ESP_SLEEP_WAKEUP_EXT0) s_state.shutterWakes++;
+	ESP_LOGI(TAG, "wake cause=%d wakes=%"PRIu32" shutter=%"PRIu32, s_cause, s_state.wakes, s_state.shutterWakes);
+
+	// The pins were held while in deep sleep
+#if CAM_PIN_PWDN >= 0
+	if (rtc_gpio_is_valid_gpio(CAM_PIN_PWDN)) {
+		rtc_gpio_hold_dis(CAM_PIN_PWDN);
+		rtc_gpio_deinit(CAM_PIN_PWDN);
+	}
+#endif
+#if CONFIG_ENABLE_FLASH
+	if (rtc_gpio_is_valid_gpio(CONFIG_GPIO_FLASH)) {
+		rtc_gpio_hold_dis(CONFIG_GPIO_FLASH);
+		rtc_gpio_deinit(CONFIG_GPIO_FLASH);
+	}
+#endif
+}
+
+bool power_woken_by_shutter(void)
+{
+	return s_cause == ESP_SLEEP_WAKEUP_EXT0;
+}
+
+// Called in the event loop task
+static void camera_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+	int64_t now = esp_timer_get_time();
+	s_activity = now;
+	if (event_id == CAMERA_EVENT_CAPTURED) {
+		s_pending++;
+		if (s_wake_to_capture == 0) s_wake_to_capture = now;
+	} else if (event_id == CAMERA_EVENT_SENT) {
+		s_pending--;
+		if (s_wake_to_sent == 0) s_wake_to_sent = now;
+		s_state.sent++;
+	} else if (event_id == CAMERA_EVENT_FAILED) {
+		// The trigger may fail before the capture
+		if (s_pending > 0) s_pending--;
+		s_wake_failed = true;
+		s_state.failed++;
+	} else if (event_id == CAMERA_EVENT_SUPPRESSED) {
+		s_pending--;
+	}
+}
+
+static void report(int64_t awake)
+{
+	s_state.awakeSum += awake;
+	if (s_wake_to_capture && power_woken_by_shutter()) {
+		s_state.captured++;
+		s_state.captureSum += s_wake_to_capture;
+		if (s_wake_to_capture > s_state.captureMax) s_state.captureMax = s_wake_to_capture;
+		if (s_wake_to_sent) {
+			s_state.sentSamples++;
+			s_state.sentSum += s_wake_to_sent;
+			if (s_wake_to_sent > s_state.sentMax) s_state.sentMax = s_wake_to_sent;
+		}
+	}
+	ESP_LOGI(TAG, "wake to capture=%"PRIi64"ms wake to sent=%"PRIi64"ms awake=%"PRIi64"ms",
+		s_wake_to_capture / 1000, s_wake_to_sent / 1000, awake / 1000);
+	ESP_LOGI(TAG, "wakes=%"PRIu32" captured=%"PRIu32" sent=%"PRIu32" failed=%"PRIu32" timeouts=%"PRIu32" avg awake=%"PRIi64"ms",
+		s_state.wakes, s_state.captured, s_state.sent, s_state.failed, s_state.timeouts, s_state.awakeSum / s_state.wakes / 1000);
+	if (s_state.captured) {
+		ESP_LOGI(TAG, "wake to capture avg=%"PRIi64"ms max=%"PRIi64"ms", s_state.captureSum / s_state.captured / 1000, s_state.captureMax / 1000);
+	}
+	if (s_state.sentSamples) {
+		ESP_LOGI(TAG, "wake to sent avg=%"PRIi64"ms max=%"PRIi64"ms", s_state.sentSum / s_state.sentSamples / 1000, s_state.sentMax / 1000);
+	}
+}
+
+#if CONFIG_SLEEP_SELFTEST
+// The picture of the shutter wake must be delivered before the chip sleeps.
+// A failed mail is a delivery error, not an error of the sleep.
+static void selftest(bool timeout)
+{
+	if (power_woken_by_shutter() == false) return;
+	bool pass = true;
+	if (s_wake_to_capture == 0) {
+		ESP_LOGE(TAG, "SELFTEST FAIL: no picture was taken after the shutter wake");
+		pass = false;
+	} else if (s_wake_to_sent == 0 && s_wake_failed == false) {
+		ESP_LOGE(TAG, "SELFTEST FAIL: sleep before the picture of the wake was delivered%s", timeout ? " (timeout)" : "");
+		pass = false;
+	} else {
+		ESP_LOGI(TAG, "SELFTEST PASS: %s before sleep", s_wake_to_sent ? "sent" : "failed");
+	}
+	if (pass) {
+		s_state.selftestPass++;
+	} else {
+		s_state.selftestFail++;
+	}
+	ESP_LOGI(TAG, "SELFTEST pass=%"PRIu32" fail=%"PRIu32, s_state.selftestPass, s_state.selftestFail);
+}
+#endif
+
+static void enter_sleep(void)
+{
+	// The button still pressed would wake the chip at once
+	for (int i=0; i<100 && gpio_get_level(CONFIG_GPIO_INPUT) == WAKE_LEVEL; i++) {
+		vTaskDelay(pdMS_TO_TICKS(20));
+	}
+
+	// Keep the sensor powered down and the flash light off while in deep sleep
+#if CAM_PIN_PWDN >= 0
+	if (rtc_gpio_is_valid_gpio(CAM_PIN_PWDN)) {
+		rtc_gpio_init(CAM_PIN_PWDN);
+		rtc_gpio_set_direction(CAM_PIN_PWDN, RTC_GPIO_MODE_OUTPUT_ONLY);
+		rtc_gpio_set_level(CAM_PIN_PWDN, 1);
+		rtc_gpio_hold_en(CAM_PIN_PWDN);
+	}
+#endif
+#if CONFIG_ENABLE_FLASH
+	if (rtc_gpio_is_valid_gpio(CONFIG_GPIO_FLASH)) {
+		rtc_gpio_init(CONFIG_GPIO_FLASH);
+		rtc_gpio_set_direction(CONFIG_GPIO_FLASH, RTC_GPIO_MODE_OUTPUT_ONLY);
+		rtc_gpio_set_level(CONFIG_GPIO_FLASH, 0);
+		rtc_gpio_hold_en(CONFIG_GPIO_FLASH);
+	}
+#endif
+
+	ESP_ERROR_CHECK(esp_sleep_enable_ext0_wakeup(CONFIG_GPIO_INPUT, WAKE_LEVEL));
+	// The pull of the digital GPIO does not work in deep sleep
+#if CONFIG_GPIO_PULLUP
+	rtc_gpio_pullup_en(CONFIG_GPIO_INPUT);
+	rtc_gpio_pulldown_dis(CONFIG_GPIO_INPUT);
+#else
+	rtc_gpio_pullup_dis(CONFIG_GPIO_INPUT);
+	rtc_gpio_pulldown_en(CONFIG_GPIO_INPUT);
+#endif
+	ESP_LOGI(TAG, "Enter deep sleep. Wake on GPIO%d level %d", CONFIG_GPIO_INPUT, WAKE_LEVEL);
+	esp_deep_sleep_start();
+}
+
+static void power_task(void *pvParameters)
+{
+	bool timeout = false;
+	while (1) {
+		vTaskDelay(pdMS_TO_TICKS(100));
+		int64_t now = esp_timer_get_time();
+		if (now > (int64_t)CONFIG_SLEEP_MAX_AWAKE * 1000000) {
+			ESP_LOGW(TAG, "Awake too long. pending=%"PRIi32, s_pending);
+			s_state.timeouts++;
+			timeout = true;
+			break;
+		}
+		if (s_pending > 0) continue;
+		// The other sinks may still deliver after the mail was sent
+		if (sink_idle() == false) {
+			s_activity = now;
+			continue;
+		}
+		int64_t last = s_activity;
+		if (now - last > (int64_t)CONFIG_SLEEP_IDLE_TIME * 1000) break;
+	}
+	report(esp_timer_get_time());
+#if CONFIG_SLEEP_SELFTEST
+	selftest(timeout);
+#else
+	(void)timeout;
+#endif
+	enter_sleep();
+	/* Never reach */
+	vTaskDelete(NULL);
+}
+
+// Called after the default event loop is created
+void power_start(void)
+{
+	if (rtc_gpio_is_valid_gpio(CONFIG_GPIO_INPUT) == false) {
+		ESP_LOGE(TAG, "GPIO%d can not wake the chip. Deep sleep is disabled", CONFIG_GPIO_INPUT);
+		return;
+	}
+	s_activity = esp_timer_get_time();
+	ESP_ERROR_CHECK(esp_event_handler_instance_register(CAMERA_EVENT, ESP_EVENT_ANY_ID, camera_event_handler, NULL, NULL));
+	xTaskCreate(power_task, "POWER", 1024*3, NULL, 1, NULL);
+}
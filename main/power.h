@@ -0,0 +1,3 @@
+void power_init(void);
+bool power_woken_by_shutter(void);
+void power_start(void);
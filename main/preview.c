@@ -0,0 +1,106 @@
+/* Small picture decoded from JPEG
+
+	The JPEG is decoded at 1/8 scale, which only uses the DC coefficients.
+	The perceptual hash and the thumbnail share the decoded picture,
+	so the JPEG is decoded only once for each capture.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+
+#include "preview.h"
+
+static const char *TAG = "PREVIEW";
+
+typedef struct {
+	const uint8_t *input;
+	size_t input_len;
+	PREVIEW_t *preview;
+} preview_ctx_t;
+
+static size_t _jpg_read(void * arg, size_t index, uint8_t *buf, size_t len)
+{
+	preview_ctx_t *ctx = (preview_ctx_t *)arg;
+	if (index >= ctx->input_len) return 0;
+	if (len > ctx->input_len - index) len = ctx->input_len - index;
+	if (buf) {
+		memcpy(buf, ctx->input + index, len);
+	}
+	return len;
+}
+
+// Called for each decoded block of RGB888.
+// fmt2jpg takes RGB888 in the order of B, G and R, so R and B are swapped here.
+static bool _jpg_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+	PREVIEW_t *preview = ((preview_ctx_t *)arg)->preview;
+	if (data == NULL) {
+		if (x == 0 && y == 0) {
+			// Start of decode. w and h are the size of the scaled picture
+			preview->width = w;
+			preview->height = h;
+			preview->rgb = heap_caps_malloc(w * h * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+			if (preview->rgb == NULL) preview->rgb = malloc(w * h * 3);
+			if (preview->rgb == NULL) {
+				ESP_LOGE(TAG, "malloc fail for %dx%d", w, h);
+				return false;
+			}
+		}
+		return true;
+	}
+	if (preview->rgb == NULL) return false;
+
+	for (int iy=0; iy<h; iy++) {
+		if (y + iy >= preview->height) break;
+		int cols = w;
+		if (x + cols > preview->width) cols = preview->width - x;
+		uint8_t *dst = preview->rgb + ((y + iy) * preview->width + x) * 3;
+		const uint8_t *src = data + iy * w * 3;
+		for (int ix=0; ix<cols; ix++) {
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst += 3;
+			src += 3;
+		}
+	}
+	return true;
+}
+
+esp_err_t preview_decode(const uint8_t *jpeg, size_t len, PREVIEW_t *preview)
+{
+	int64_t start = esp_timer_get_time();
+	memset(preview, 0, sizeof(PREVIEW_t));
+	preview_ctx_t ctx = {
+		.input = jpeg,
+		.input_len = len,
+		.preview = preview,
+	};
+
+	esp_err_t ret = esp_jpg_decode(len, JPG_SCALE_8X, _jpg_read, _jpg_write, (void*)&ctx);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "esp_jpg_decode fail (%s)", esp_err_to_name(ret));
+		preview_free(preview);
+		return ret;
+	}
+	ESP_LOGI(TAG, "picture=%d bytes preview=%dx%d decode=%"PRIi64"us",
+		(int)len, preview->width, preview->height, esp_timer_get_time() - start);
+	return ESP_OK;
+}
+
+void preview_free(PREVIEW_t *preview)
+{
+	free(preview->rgb);
+	preview->rgb = NULL;
+}
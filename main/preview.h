@@ -0,0 +1,10 @@
+// Picture decoded at 1/8 scale in RGB888 with the byte order of B, G and R, as fmt2jpg takes it.
+// The perceptual hash and the thumbnail are made from one decode.
+typedef struct {
+	uint16_t width;
+	uint16_t height;
+	uint8_t *rgb; // width * height * 3 bytes of B, G and R
+} PREVIEW_t;
+
+esp_err_t preview_decode(const uint8_t *jpeg, size_t len, PREVIEW_t *preview);
+void preview_free(PREVIEW_t *preview);
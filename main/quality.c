@@ -0,0 +1,90 @@
+/* JPEG quality controller
+
+	Choose the JPEG quality of the sensor so that
+	the size of picture stays under the target size.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_camera.h"
+
+static const char *TAG = "QUALITY";
+
+#define TARGET_SIZE CONFIG_QUALITY_TARGET_SIZE
+#define QUALITY_LIMIT CONFIG_QUALITY_LIMIT
+#define FRAMESIZE_LIMIT FRAMESIZE_QVGA
+
+static int s_quality_best;
+static int s_quality;
+static int s_framesize_best;
+static int s_framesize;
+static uint32_t s_average;
+
+void quality_init(int quality, int framesize)
+{
+	s_quality_best = s_quality = quality;
+	s_framesize_best = s_framesize = framesize;
+	s_average = 0;
+	ESP_LOGI(TAG, "target=%d quality=%d limit=%d", TARGET_SIZE, s_quality, QUALITY_LIMIT);
+}
+
+// The settings recommended for the next picture
+void quality_get(int *quality, int *framesize)
+{
+	*quality = s_quality;
+	*framesize = s_framesize;
+}
+
+/*
+ * Feed the size of a frame to the controller.
+ * The average of recent frames is compared with the target size.
+ * Over the target, the quality is lowered in proportion to the excess.
+ * Well under the target, the quality is raised one step at a time.
+ */
+void quality_update(size_t len)
+{
+	if (s_average == 0) {
+		s_average = len;
+	} else {
+		s_average = (s_average + len) / 2;
+	}
+
+	int quality = s_quality;
+	int framesize = s_framesize;
+	if (s_average > TARGET_SIZE) {
+		int step = ((s_average - TARGET_SIZE) * 10) / TARGET_SIZE + 1;
+		quality = quality + step;
+		if (quality > QUALITY_LIMIT) {
+			quality = QUALITY_LIMIT;
+#if CONFIG_QUALITY_CONTROL_FRAMESIZE
+			if (s_quality == QUALITY_LIMIT && framesize > FRAMESIZE_LIMIT) {
+				framesize--;
+				quality = s_quality_best;
+			}
+#endif
+		}
+	} else if (s_average < (TARGET_SIZE / 4) * 3) {
+		if (quality > s_quality_best) {
+			quality--;
+#if CONFIG_QUALITY_CONTROL_FRAMESIZE
+		} else if (framesize < s_framesize_best && s_average < TARGET_SIZE / 3) {
+			framesize++;
+#endif
+		}
+	}
+
+	ESP_LOGI(TAG, "len=%d average=%"PRIu32" quality=%d->%d framesize=%d->%d",
+		(int)len, s_average, s_quality, quality, s_framesize, framesize);
+	if (framesize != s_framesize) {
+		// The size of the previous frame size is no longer relevant
+		s_average = 0;
+	}
+	s_quality = quality;
+	s_framesize = framesize;
+}
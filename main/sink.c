@@ -0,0 +1,135 @@
+/* Delivery sinks
+
+	The camera task submits each picture to all registered sinks at once.
+	The sinks share one frame buffer, and the last one to release it returns it to the driver.
+	The camera task waits with sink_flush() before the frame buffer is used for the next picture.
+	A sink may keep pictures after flush, and sink_idle() is false until they are delivered.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+
+#include "cmd.h"
+#include "sink.h"
+
+static const char *TAG = "SINK";
+
+#define MAX_SINKS 6
+
+static const SINK_t *s_sinks[MAX_SINKS];
+static int s_sink_count = 0;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static volatile int s_busy = 0; // Submitted but not flushed yet
+
+// Called in app_main before the camera task starts
+void sink_register(const SINK_t *sink)
+{
+	if (s_sink_count == MAX_SINKS) {
+		ESP_LOGE(TAG, "Too many sinks. %s is not registered", sink->name);
+		return;
+	}
+	s_sinks[s_sink_count++] = sink;
+	ESP_LOGI(TAG, "Register %s", sink->name);
+}
+
+bool sink_uses_frame_buffer(void)
+{
+	for (int i=0; i<s_sink_count; i++) {
+		if (s_sinks[i]->usesFrameBuffer) return true;
+	}
+	return false;
+}
+
+// The sinks are called in the order of registration.
+// A sink that delivers in its own task should be registered before the sinks that deliver in submit.
+void sink_submit(SINK_FRAME_t *frame)
+{
+	taskENTER_CRITICAL(&s_mux);
+	s_busy++;
+	taskEXIT_CRITICAL(&s_mux);
+	for (int i=0; i<s_sink_count; i++) {
+		esp_err_t ret = s_sinks[i]->submit(frame);
+		if (ret != ESP_OK && ret != ESP_ERR_NOT_SUPPORTED) {
+			ESP_LOGW(TAG, "%s: submit of %"PRIu32" failed %s", s_sinks[i]->name, frame->info.triggerId, esp_err_to_name(ret));
+		}
+	}
+}
+
+void sink_flush(void)
+{
+	for (int i=0; i<s_sink_count; i++) {
+		if (s_sinks[i]->flush) s_sinks[i]->flush();
+	}
+	taskENTER_CRITICAL(&s_mux);
+	if (s_busy > 0) s_busy--;
+	taskEXIT_CRITICAL(&s_mux);
+}
+
+// true when no sink is delivering a picture
+bool sink_idle(void)
+{
+	if (s_busy != 0) return false;
+	for (int i=0; i<s_sink_count; i++) {
+		if (s_sinks[i]->idle && s_sinks[i]->idle() == false) return false;
+	}
+	return true;
+}
+
+void sink_dump(void)
+{
+	for (int i=0; i<s_sink_count; i++) {
+		SINK_STATS_t stats;
+		s_sinks[i]->stats(&stats);
+		ESP_LOGI(TAG, "%s: submitted=%"PRIu32" skipped=%"PRIu32" done=%"PRIu32" failed=%"PRIu32" bytes=%"PRIu64" latency=%"PRIi64"ms max=%"PRIi64"ms",
+			s_sinks[i]->name, stats.submitted, stats.skipped, stats.done, stats.failed, stats.bytes,
+			stats.latencyLast / 1000, stats.latencyMax / 1000);
+	}
+}
+
+SINK_FRAME_t *sink_frame_ref(SINK_FRAME_t *frame)
+{
+	taskENTER_CRITICAL(&s_mux);
+	frame->refs++;
+	taskEXIT_CRITICAL(&s_mux);
+	return frame;
+}
+
+void sink_frame_unref(SINK_FRAME_t *frame)
+{
+	taskENTER_CRITICAL(&s_mux);
+	int refs = --frame->refs;
+	taskEXIT_CRITICAL(&s_mux);
+	if (refs == 0 && frame->fb) {
+		esp_camera_fb_return(frame->fb);
+		frame->fb = NULL;
+	}
+}
+
+// Count the result of submit, or of the delivery when the sink delivers later
+void sink_stats_update(SINK_STATS_t *stats, esp_err_t result, size_t bytes, int64_t triggerTime)
+{
+	if (result == ESP_ERR_NOT_SUPPORTED) {
+		stats->skipped++;
+		return;
+	}
+	stats->submitted++;
+	if (result != ESP_OK) {
+		stats->failed++;
+		return;
+	}
+	stats->done++;
+	stats->bytes += bytes;
+	stats->latencyLast = esp_timer_get_time() - triggerTime;
+	if (stats->latencyLast > stats->latencyMax) stats->latencyMax = stats->latencyLast;
+}
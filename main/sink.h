@@ -0,0 +1,42 @@
+// A picture shared by the sinks without copy.
+// The frame buffer is returned to the driver when the last reference is released.
+typedef struct {
+	int refs;
+	camera_fb_t *fb; // NULL when no sink uses the frame buffer
+	SMTP_t info; // Trigger, size and file names of the picture
+	bool direct; // The shutter receives the frame buffer directly
+	bool suppressed; // Near-duplicate picture. Only the shutter that requested it receives it
+} SINK_FRAME_t;
+
+typedef struct {
+	uint32_t submitted;
+	uint32_t skipped; // Not for this sink
+	uint32_t done;
+	uint32_t failed;
+	uint64_t bytes;
+	int64_t latencyLast; // Time from trigger to the end of delivery in microseconds
+	int64_t latencyMax;
+} SINK_STATS_t;
+
+typedef struct {
+	const char *name;
+	bool usesFrameBuffer; // false when the sink reads the local file
+	// Returns ESP_ERR_NOT_SUPPORTED when the picture is not for this sink.
+	// A sink that keeps the frame after return takes a reference.
+	esp_err_t (*submit)(SINK_FRAME_t *frame);
+	// Wait until the sink no longer uses the frame buffer
+	void (*flush)(void);
+	// true when nothing waits for delivery. NULL when the sink is idle after flush
+	bool (*idle)(void);
+	void (*stats)(SINK_STATS_t *stats);
+} SINK_t;
+
+void sink_register(const SINK_t *sink);
+bool sink_uses_frame_buffer(void);
+void sink_submit(SINK_FRAME_t *frame);
+void sink_flush(void);
+bool sink_idle(void);
+void sink_dump(void);
+SINK_FRAME_t *sink_frame_ref(SINK_FRAME_t *frame);
+void sink_frame_unref(SINK_FRAME_t *frame);
+void sink_stats_update(SINK_STATS_t *stats, esp_err_t result, size_t bytes, int64_t triggerTime);
@@ -22,12 +22,15 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "mbedtls/platform.h"
 #include "mbedtls/net_sockets.h"
@@ -41,11 +44,25 @@
 //#include "mbedtls/certs.h"
 #include "mbedtls/base64.h"
 #include "mbedtls/version.h"
+#include "esp_camera.h"
 
 #include "cmd.h"
+#include "affinity.h"
+#include "archive.h"
+#include "discovery.h"
+#include "wifi_manager.h"
+#include "sink.h"
 
 extern QueueHandle_t xQueueSmtp;
-extern SemaphoreHandle_t xSemaphoreSmtp;
+extern SemaphoreHandle_t xSemaphoreSmtpDone;
+
+static SINK_STATS_t s_sink_stats;
+
+// The pictures waiting for the mail are kept in the slot files.
+// The slots are used in turn, and the mails are sent in the same order,
+// so the next slot is always the oldest one.
+static int s_slot_next = 0;
+static int s_slot_reserved = -1; // Taken by the camera task and not queued yet
 
 /* Constants that are configurable in menuconfig */
 #define MAIL_SERVER			CONFIG_SMTP_SERVER
@@ -211,6 +228,269 @@ static int write_ssl_data(mbedtls_ssl_context *ssl, unsigned char *buf, size_t l
 	return 0;
 }
 
+#if CONFIG_ENABLE_EXIF
+size_t exif_build(uint8_t *buf, size_t size, time_t captureTime, int width, int height, int quality);
+#define HEAD_SIZE 512
+#else
+#define HEAD_SIZE 2
+#endif
+
+/*
+ * Source of the attachment.
+ * The picture is read from the file, or from the archive when fp is NULL.
+ * The bytes in head are read before the rest of the picture.
+ * It is used to insert the APP1 segment right after the SOI marker.
+ */
+typedef struct {
+	FILE *fp;
+	uint32_t seq; // Sequence number in archive
+	size_t pos; // Read position in archive
+	size_t size; // Size of picture in archive
+	uint8_t head[HEAD_SIZE];
+	size_t head_len;
+	size_t head_pos;
+} SOURCE_t;
+
+static size_t source_read_picture(SOURCE_t *src, uint8_t *buf, size_t len)
+{
+	if (src->fp) return fread(buf, 1, len, src->fp);
+#if CONFIG_STORAGE_ARCHIVE
+	if (len > src->size - src->pos) len = src->size - src->pos;
+	if (len == 0) return 0;
+	if (archive_read(src->seq, src->pos, buf, len) != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to read archive seq=%"PRIu32, src->seq);
+		return 0;
+	}
+	src->pos += len;
+	return len;
+#else
+	return 0;
+#endif
+}
+
+static void source_rewind(SOURCE_t *src)
+{
+	if (src->fp) rewind(src->fp);
+	src->pos = 0;
+}
+
+static size_t source_read(SOURCE_t *src, uint8_t *buf, size_t len)
+{
+	size_t n = 0;
+	if (src->head_pos < src->head_len) {
+		n = src->head_len - src->head_pos;
+		if (n > len) n = len;
+		memcpy(buf, src->head + src->head_pos, n);
+		src->head_pos += n;
+	}
+	if (n < len) {
+		n += source_read_picture(src, buf + n, len - n);
+	}
+	return n;
+}
+
+#if CONFIG_ENABLE_SMTP_PIPELINE
+/*
+ * Pipeline of the attachment.
+ * The reader, the base64 encoder and the TLS writer run concurrently,
+ * connected by double-buffered blocks.
+ * reader --(xQueueRawFull)--> encoder --(xQueueB64Full)--> writer(smtp_client_task)
+ * Empty blocks are returned through xQueueRawFree and xQueueB64Free.
+ */
+#define PIPE_DEPTH 2
+#define LINE_BYTES 93 // Bytes of source encoded in one line
+#define LINE_CHARS 126 // 124 characters of base64 and CRLF
+#define BLOCK_LINES 16
+
+typedef struct {
+	size_t len;
+	bool eof;
+	int error; // Error of the encoder. 0 when the block is encoded
+	uint8_t data[LINE_CHARS * BLOCK_LINES + 1];
+} BLOCK_t;
+
+static QueueHandle_t xQueueReader;
+static QueueHandle_t xQueueRawFree;
+static QueueHandle_t xQueueRawFull;
+static QueueHandle_t xQueueB64Free;
+static QueueHandle_t xQueueB64Full;
+
+static void pipeline_reader(void *pvParameters)
+{
+	SOURCE_t *src;
+	BLOCK_t *block;
+	while(1) {
+		xQueueReceive(xQueueReader, &src, portMAX_DELAY);
+		do {
+			xQueueReceive(xQueueRawFree, &block, portMAX_DELAY);
+			block->len = source_read(src, block->data, LINE_BYTES * BLOCK_LINES);
+			block->eof = (block->len < LINE_BYTES * BLOCK_LINES);
+			xQueueSend(xQueueRawFull, &block, portMAX_DELAY);
+		} while (!block->eof);
+	}
+}
+
+static void pipeline_encoder(void *pvParameters)
+{
+	BLOCK_t *raw;
+	BLOCK_t *b64;
+	size_t base64_len;
+	while(1) {
+		xQueueReceive(xQueueRawFull, &raw, portMAX_DELAY);
+		xQueueReceive(xQueueB64Free, &b64, portMAX_DELAY);
+		b64->len = 0;
+		b64->error = 0;
+		for (size_t pos=0; pos<raw->len; pos+=LINE_BYTES) {
+			size_t read_length = raw->len - pos;
+			if (read_length > LINE_BYTES) read_length = LINE_BYTES;
+			int ret = mbedtls_base64_encode(b64->data + b64->len, sizeof(b64->data) - b64->len,
+				&base64_len, raw->data + pos, read_length);
+			if (ret != 0) {
+				ESP_LOGE(TAG, "Error in mbedtls encode! ret = -0x%x", -ret);
+				b64->error = ret;
+				break;
+			}
+			b64->len += base64_len;
+			b64->data[b64->len++] = '\r';
+			b64->data[b64->len++] = '\n';
+		}
+		b64->data[b64->len] = 0;
+		b64->eof = raw->eof;
+		xQueueSend(xQueueRawFree, &raw, portMAX_DELAY);
+		xQueueSend(xQueueB64Full, &b64, portMAX_DELAY);
+	}
+}
+
+static void pipeline_init(void)
+{
+	xQueueReader = xQueueCreate( 1, sizeof(SOURCE_t *) );
+	xQueueRawFree = xQueueCreate( PIPE_DEPTH, sizeof(BLOCK_t *) );
+	xQueueRawFull = xQueueCreate( PIPE_DEPTH, sizeof(BLOCK_t *) );
+	xQueueB64Free = xQueueCreate( PIPE_DEPTH, sizeof(BLOCK_t *) );
+	xQueueB64Full = xQueueCreate( PIPE_DEPTH, sizeof(BLOCK_t *) );
+	configASSERT( xQueueReader );
+	configASSERT( xQueueRawFree );
+	configASSERT( xQueueRawFull );
+	configASSERT( xQueueB64Free );
+	configASSERT( xQueueB64Full );
+	for (int i=0; i<PIPE_DEPTH; i++) {
+		BLOCK_t *block = (BLOCK_t *)malloc(sizeof(BLOCK_t));
+		configASSERT( block );
+		xQueueSend(xQueueRawFree, &block, 0);
+		block = (BLOCK_t *)malloc(sizeof(BLOCK_t));
+		configASSERT( block );
+		xQueueSend(xQueueB64Free, &block, 0);
+	}
+	xTaskCreatePinnedToCore(pipeline_reader, "READER", 1024*3, NULL, 5, NULL, CAPTURE_CORE);
+	xTaskCreatePinnedToCore(pipeline_encoder, "ENCODER", 1024*3, NULL, 5, NULL, ENCODER_CORE);
+}
+
+/* Write the contents of the source encoded in base64 */
+static int write_ssl_source(mbedtls_ssl_context *ssl, unsigned char *buf, SOURCE_t *src)
+{
+	int ret = 0;
+	BLOCK_t *block;
+	xQueueSend(xQueueReader, &src, portMAX_DELAY);
+	do {
+		xQueueReceive(xQueueB64Full, &block, portMAX_DELAY);
+		// The attachment is broken, so the mail must not be sent
+		if (ret == 0 && block->error) ret = block->error;
+		// Keep draining the pipeline after an error, so that the next mail starts clean
+		for (size_t pos=0; ret == 0 && pos<block->len; ) {
+			ret = mbedtls_ssl_write(ssl, block->data + pos, block->len - pos);
+			if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+				ret = 0;
+			} else if (ret < 0) {
+				ESP_LOGE(TAG, "mbedtls_ssl_write failed with error -0x%x", -ret);
+			} else {
+				pos += ret;
+				ret = 0;
+			}
+		}
+		xQueueSend(xQueueB64Free, &block, portMAX_DELAY);
+	} while (!block->eof);
+	return ret;
+}
+#else
+/* Write the contents of the source encoded in base64 */
+static int write_ssl_source(mbedtls_ssl_context *ssl, unsigned char *buf, SOURCE_t *src)
+{
+	int ret = 0;
+	int len;
+	unsigned char base64_buffer[128];
+	size_t base64_len;
+
+	int read_bytes = ((sizeof (base64_buffer) - 1) / 4) * 3;
+	unsigned char read_buffer[128];
+	while (1) {
+		int read_length = source_read(src, read_buffer, read_bytes);
+		ESP_LOGD(TAG, "read_length=%d", read_length);
+		if (read_length == 0) break;
+		ret = mbedtls_base64_encode((unsigned char *) base64_buffer, sizeof(base64_buffer),
+			&base64_len, read_buffer, read_length);
+		if (ret != 0) {
+			ESP_LOGE(TAG, "Error in mbedtls encode! ret = -0x%x", -ret);
+			break;
+		}
+		len = snprintf((char *) buf, BUF_SIZE, "%s\r\n", base64_buffer);
+		write_ssl_data(ssl, (unsigned char *) buf, len);
+	}
+	return ret;
+}
+
+#endif
+
+/* Write the contents of the file encoded in base64 */
+static int write_ssl_file(mbedtls_ssl_context *ssl, unsigned char *buf, char *fileName)
+{
+	ESP_LOGI(TAG, "Reading file %s", fileName);
+	SOURCE_t src;
+	memset(&src, 0, sizeof(src));
+	//src.fp = fopen("/spiffs/esp_logo.png", "rb");
+	src.fp = fopen(fileName, "rb");
+	if (src.fp == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return 0;
+	}
+	int ret = write_ssl_source(ssl, buf, &src);
+	fclose(src.fp);
+	return ret;
+}
+
+/* Write the picture encoded in base64 */
+static int write_ssl_picture(mbedtls_ssl_context *ssl, unsigned char *buf, SMTP_t *smtpBuf)
+{
+	SOURCE_t src;
+	memset(&src, 0, sizeof(src));
+#if CONFIG_STORAGE_ARCHIVE
+	ESP_LOGI(TAG, "Reading archive seq=%"PRIu32, smtpBuf->archiveSeq);
+	src.seq = smtpBuf->archiveSeq;
+	src.size = smtpBuf->localFileSize;
+#else
+	ESP_LOGI(TAG, "Reading file %s", smtpBuf->localFileName);
+	src.fp = fopen(smtpBuf->localFileName, "rb");
+	if (src.fp == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for reading");
+		return 0;
+	}
+#endif
+#if CONFIG_ENABLE_EXIF
+	// Insert APP1 segment after SOI marker
+	if (source_read_picture(&src, src.head, 2) == 2 && src.head[0] == 0xFF && src.head[1] == 0xD8) {
+		size_t app1_len = exif_build(src.head + 2, sizeof(src.head) - 2,
+			smtpBuf->captureTime, smtpBuf->width, smtpBuf->height, smtpBuf->quality);
+		src.head_len = 2 + app1_len;
+		ESP_LOGI(TAG, "APP1 segment %d bytes inserted", (int)app1_len);
+	} else {
+		ESP_LOGW(TAG, "SOI marker not found");
+		source_rewind(&src);
+	}
+#endif
+	int ret = write_ssl_source(ssl, buf, &src);
+	if (src.fp) fclose(src.fp);
+	return ret;
+}
+
 static int perform_tls_handshake(mbedtls_ssl_context *ssl)
 {
 	int ret = -1;
@@ -365,6 +645,10 @@ void smtp_client_task(void *pvParameters)
 
 	ESP_LOGI(TAG, "ESP_IDF_VERSION_MAJOR=%d", ESP_IDF_VERSION_MAJOR);
 
+#if CONFIG_ENABLE_SMTP_PIPELINE
+	pipeline_init();
+#endif
+
 	smtp_client_mbedtls_handle_t *client = NULL;
 	client = (smtp_client_mbedtls_handle_t*)calloc(1,sizeof(smtp_client_mbedtls_handle_t));
 	if (client == NULL) {
@@ -391,19 +675,29 @@ void smtp_client_task(void *pvParameters)
 	SMTP_t smtpBuf;
 	while(1) {
 		ESP_LOGI(TAG,"Waitting...");
-		xSemaphoreGive(xSemaphoreSmtp);
-
 		xQueueReceive(xQueueSmtp, &smtpBuf, portMAX_DELAY);
 		ESP_LOGI(TAG,"smtpBuf.command=%d", smtpBuf.command);
 		if (smtpBuf.command == CMD_HALT) break;
 
-		xSemaphoreTake(xSemaphoreSmtp, portMAX_DELAY);
 		ESP_LOGI(TAG,"smtpBuf.localFileName[%s]", smtpBuf.localFileName);
+#if CONFIG_STORAGE_ARCHIVE
+		ESP_LOGI(TAG,"smtpBuf.archiveSeq=%"PRIu32, smtpBuf.archiveSeq);
+#endif
 		ESP_LOGI(TAG,"smtpBuf.remoteFileName[%s]", smtpBuf.remoteFileName);
+		ESP_LOGI(TAG,"smtpBuf.thumbFileName[%s]", smtpBuf.thumbFileName);
 
-		ESP_LOGI(TAG, "Connecting to %s:%s...", MAIL_SERVER, MAIL_PORT);
+		// The picture is kept in the queue while the network is down
+		if (wifi_manager_connected() == false) {
+			ESP_LOGW(TAG, "Waiting for WiFi...");
+			wifi_manager_wait(portMAX_DELAY);
+		}
+
+		// A relay on the local network may be named by mDNS
+		char server[64];
+		discovery_resolve(MAIL_SERVER, server, sizeof(server));
+		ESP_LOGI(TAG, "Connecting to %s(%s):%s...", MAIL_SERVER, server, MAIL_PORT);
 
-		if ((ret = mbedtls_net_connect(&client->server_fd, MAIL_SERVER, MAIL_PORT, MBEDTLS_NET_PROTO_TCP)) != 0) {
+		if ((ret = mbedtls_net_connect(&client->server_fd, server, MAIL_PORT, MBEDTLS_NET_PROTO_TCP)) != 0) {
 			ESP_LOGE(TAG, "mbedtls_net_connect returned -0x%x", -ret);
 			goto exit;
 		}
@@ -490,10 +784,16 @@ void smtp_client_task(void *pvParameters)
 		ret = write_ssl_and_get_response(&client->ssl, (unsigned char *) buf, len);
 		VALIDATE_MBEDTLS_RETURN(ret, 200, 299, exit);
 
-		ESP_LOGI(TAG, "Write RCPT");
-		len = snprintf((char *) buf, BUF_SIZE, "RCPT TO:<%s>\r\n", RECIPIENT_MAIL);
-		ret = write_ssl_and_get_response(&client->ssl, (unsigned char *) buf, len);
-		VALIDATE_MBEDTLS_RETURN(ret, 200, 299, exit);
+		// The shutter may specify the recipients
+		char recipients[sizeof(RECIPIENT_MAIL) > RECIPIENTS_SIZE ? sizeof(RECIPIENT_MAIL) : RECIPIENTS_SIZE];
+		strlcpy(recipients, strlen(smtpBuf.to) ? smtpBuf.to : RECIPIENT_MAIL, sizeof(recipients));
+		char *save;
+		for (char *rcpt = strtok_r(recipients, ",", &save); rcpt != NULL; rcpt = strtok_r(NULL, ",", &save)) {
+			ESP_LOGI(TAG, "Write RCPT %s", rcpt);
+			len = snprintf((char *) buf, BUF_SIZE, "RCPT TO:<%s>\r\n", rcpt);
+			ret = write_ssl_and_get_response(&client->ssl, (unsigned char *) buf, len);
+			VALIDATE_MBEDTLS_RETURN(ret, 200, 299, exit);
+		}
 
 		ESP_LOGI(TAG, "Write DATA");
 		len = snprintf((char *) buf, BUF_SIZE, "DATA\r\n");
@@ -506,7 +806,7 @@ void smtp_client_task(void *pvParameters)
 			"From: %s\r\nSubject: mbed TLS mail\r\n"
 			"To: %s\r\n"
 			"MIME-Version: 1.0 (mime-construct 1.9)\n",
-			"ESP32 SMTP Client", RECIPIENT_MAIL);
+			"ESP32 SMTP Client", strlen(smtpBuf.to) ? smtpBuf.to : RECIPIENT_MAIL);
 
 		/**
 		 * Note: We are not validating return for some ssl_writes.
@@ -520,15 +820,49 @@ void smtp_client_task(void *pvParameters)
 			"--XYZabcd1234\n");
 		ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
 
-		/* Text */
-		len = snprintf((char *) buf, BUF_SIZE,
-			"Content-Type: text/plain; charset=UTF-8; format=flowed\n"
-			"Content-Transfer-Encoding: 7bit\n"
-			"Your ESP-IDF is %s.\r\n"
-			"Your MBEDTLS is %s.\r\n"
-			"\n\n--XYZabcd1234\n",
-			esp_get_idf_version(), MBEDTLS_VERSION_STRING_FULL);
-		ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
+#if CONFIG_ENABLE_THUMBNAIL
+		if (strlen(smtpBuf.thumbFileName)) {
+			/* Text and thumbnail displayed inline */
+			len = snprintf((char *) buf, BUF_SIZE,
+				"Content-Type: multipart/related;boundary=RELabcd1234\n\n"
+				"--RELabcd1234\n"
+				"Content-Type: text/html; charset=UTF-8\n"
+				"Content-Transfer-Encoding: 7bit\n\n"
+				"<html><body>\r\n"
+				"<p>Your ESP-IDF is %s.<br>Your MBEDTLS is %s.</p>\r\n"
+				"<img src=\"cid:thumbnail\" alt=\"%s\">\r\n"
+				"</body></html>\r\n"
+				"\n--RELabcd1234\n",
+				esp_get_idf_version(), MBEDTLS_VERSION_STRING_FULL, smtpBuf.remoteFileName);
+			ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
+
+			len = snprintf((char *) buf, BUF_SIZE,
+				"Content-Type: image/jpeg;name=thumbnail.jpg\n"
+				"Content-Transfer-Encoding: base64\n"
+				"Content-ID: <thumbnail>\n"
+				"Content-Disposition:inline;filename=\"thumbnail.jpg\"\n\n");
+			ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
+
+			ret = write_ssl_file(&client->ssl, (unsigned char *) buf, smtpBuf.thumbFileName);
+			if (ret != 0) {
+				goto exit;
+			}
+
+			len = snprintf((char *) buf, BUF_SIZE, "\n--RELabcd1234--\n\n--XYZabcd1234\n");
+			ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
+		} else
+#endif
+		{
+			/* Text */
+			len = snprintf((char *) buf, BUF_SIZE,
+				"Content-Type: text/plain; charset=UTF-8; format=flowed\n"
+				"Content-Transfer-Encoding: 7bit\n"
+				"Your ESP-IDF is %s.\r\n"
+				"Your MBEDTLS is %s.\r\n"
+				"\n\n--XYZabcd1234\n",
+				esp_get_idf_version(), MBEDTLS_VERSION_STRING_FULL);
+			ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
+		}
 
 		/* Attachment */
 #if 0
@@ -547,29 +881,14 @@ void smtp_client_task(void *pvParameters)
 
 
 		/* Image contents... */
-		ESP_LOGI(TAG, "Reading file");
-		int read_bytes = ((sizeof (base64_buffer) - 1) / 4) * 3;
-		unsigned char read_buffer[128];
-		//FILE* fp = fopen("/spiffs/esp_logo.png", "rb");
-		FILE* fp = fopen(smtpBuf.localFileName, "rb");
-		if (fp == NULL) {
-			ESP_LOGE(TAG, "Failed to open file for reading");
-		} else {
-			while (!feof(fp)) {
-				//int read_length = fread(read_buffer, read_bytes, 1, fp);
-				int read_length = fread(read_buffer, 1, read_bytes, fp);
-				ESP_LOGD(TAG, "read_length=%d", read_length);
-				ret = mbedtls_base64_encode((unsigned char *) base64_buffer, sizeof(base64_buffer),
-					&base64_len, read_buffer, read_length);
-				if (ret != 0) {
-					ESP_LOGE(TAG, "Error in mbedtls encode! ret = -0x%x", -ret);
-					goto exit;
-				}
-				len = snprintf((char *) buf, BUF_SIZE, "%s\r\n", base64_buffer);
-				ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
-			}
-			fclose(fp);
+		int64_t start = esp_timer_get_time();
+		ret = write_ssl_picture(&client->ssl, (unsigned char *) buf, &smtpBuf);
+		if (ret != 0) {
+			goto exit;
 		}
+		int64_t elapsed = esp_timer_get_time() - start;
+		ESP_LOGI(TAG, "Attachment %d bytes sent in %"PRIi64"us (%"PRIi64" KB/s) core=%d",
+			(int)smtpBuf.localFileSize, elapsed, (elapsed == 0) ? 0 : ((int64_t)smtpBuf.localFileSize * 1000000 / elapsed) / 1024, xPortGetCoreID());
 
 		len = snprintf((char *) buf, BUF_SIZE, "\n--XYZabcd1234\n");
 		ret = write_ssl_data(&client->ssl, (unsigned char *) buf, len);
@@ -578,6 +897,11 @@ void smtp_client_task(void *pvParameters)
 		ret = write_ssl_and_get_response(&client->ssl, (unsigned char *) buf, len);
 		VALIDATE_MBEDTLS_RETURN(ret, 200, 299, exit);
 		ESP_LOGI(TAG, "Email sent!");
+#if CONFIG_STORAGE_ARCHIVE
+		archive_set_state(smtpBuf.archiveSeq, ARCHIVE_STATE_SENT);
+#endif
+		cmd_post_event(CAMERA_EVENT_SENT, smtpBuf.triggerId, smtpBuf.source, smtpBuf.triggerTime);
+		sink_stats_update(&s_sink_stats, ESP_OK, smtpBuf.localFileSize, smtpBuf.triggerTime);
 
 		/* Close connection */
 		mbedtls_ssl_close_notify(&client->ssl);
@@ -588,14 +912,99 @@ exit:
 		mbedtls_net_free(&client->server_fd);
 
 		if (ret != 0) {
-			mbedtls_strerror(ret, buf, 100);
-			ESP_LOGE(TAG, "Last error was: -0x%x - %s", -ret, buf);
+			char error[100];
+			mbedtls_strerror(ret, error, sizeof(error));
+			ESP_LOGE(TAG, "Last error was: -0x%x - %s", -ret, error);
+#if CONFIG_STORAGE_ARCHIVE
+			archive_set_state(smtpBuf.archiveSeq, ARCHIVE_STATE_FAILED);
+#endif
+			cmd_post_event(CAMERA_EVENT_FAILED, smtpBuf.triggerId, smtpBuf.source, smtpBuf.triggerTime);
+			sink_stats_update(&s_sink_stats, ESP_FAIL, 0, smtpBuf.triggerTime);
 		}
 
 		putchar('\n'); /* Just a new line */
 		if (buf) {
 			free(buf);
+			buf = NULL;
 		}
+
+		// The camera task may overwrite the slot from now
+		xSemaphoreGive(xSemaphoreSmtpDone);
 	} // end while
 	vTaskDelete(NULL);
 }
+
+/*
+ * Called in the camera task before the capture.
+ * Take a free slot and set the names of its files.
+ * Returns ESP_ERR_NO_MEM when all slots wait for the mail.
+ */
+esp_err_t smtp_slot_reserve(char *localFileName, char *thumbFileName)
+{
+	if (xSemaphoreTake(xSemaphoreSmtpDone, 0) != pdTRUE) {
+		ESP_LOGW(TAG, "%d pictures wait for the mail", CONFIG_SMTP_BACKLOG);
+		return ESP_ERR_NO_MEM;
+	}
+	s_slot_reserved = s_slot_next;
+	s_slot_next = (s_slot_next + 1) % CONFIG_SMTP_BACKLOG;
+	sprintf(localFileName, "/spiffs/picture%d.jpg", s_slot_reserved);
+	sprintf(thumbFileName, "/spiffs/thumbnail%d.jpg", s_slot_reserved);
+	return ESP_OK;
+}
+
+// The reserved slot is not queued. The next picture uses it again
+void smtp_slot_release(void)
+{
+	if (s_slot_reserved < 0) return;
+	s_slot_next = s_slot_reserved;
+	s_slot_reserved = -1;
+	xSemaphoreGive(xSemaphoreSmtpDone);
+}
+
+/*
+ * The mail is sent from the slot files in smtp_client_task.
+ * The camera task does not wait for the mail, so the pictures are kept in the slots
+ * while the network is down, and they are sent in order after the reconnect.
+ * Only smtp_client_task gives back a queued slot.
+ */
+static esp_err_t smtp_sink_submit(SINK_FRAME_t *frame)
+{
+	if (frame->suppressed) {
+		smtp_slot_release();
+		sink_stats_update(&s_sink_stats, ESP_ERR_NOT_SUPPORTED, 0, 0);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	if (xQueueSend(xQueueSmtp, &frame->info, 10) != pdPASS) {
+		smtp_slot_release();
+		// The mail is never sent, so the picture is reported as failed here
+		ESP_LOGE(TAG, "xQueueSend fail");
+#if CONFIG_STORAGE_ARCHIVE
+		archive_set_state(frame->info.archiveSeq, ARCHIVE_STATE_FAILED);
+#endif
+		cmd_post_event(CAMERA_EVENT_FAILED, frame->info.triggerId, frame->info.source, frame->info.triggerTime);
+		sink_stats_update(&s_sink_stats, ESP_FAIL, 0, frame->info.triggerTime);
+		return ESP_FAIL;
+	}
+	s_slot_reserved = -1;
+	return ESP_OK;
+}
+
+// true when no picture waits for the mail
+static bool smtp_sink_idle(void)
+{
+	return uxSemaphoreGetCount(xSemaphoreSmtpDone) == CONFIG_SMTP_BACKLOG;
+}
+
+static void smtp_sink_stats(SINK_STATS_t *stats)
+{
+	*stats = s_sink_stats;
+}
+
+const SINK_t smtp_sink = {
+	.name = "SMTP",
+	.usesFrameBuffer = false,
+	.submit = smtp_sink_submit,
+	.flush = NULL,
+	.idle = smtp_sink_idle,
+	.stats = smtp_sink_stats,
+};
@@ -1,5 +1,20 @@
 /* BSD Socket API Example
 
+   TCP control server for multiple clients.
+   Commands are lines terminated by LF.
+     take [framesize=VGA quality=10 flash=on]  -> OK id / COALESCED id / BUSY / FAIL
+     get [framesize=VGA quality=10 flash=on]   -> same as take, then JPEG id len and len bytes of the picture
+     burst N [INTERVAL_MS] [framesize=VGA ...] -> OK burst N, then one result for each trigger
+     stats                                     -> STATS lines, then END
+     cancel                                    -> CANCELLED n
+   When the picture for a trigger is delivered, an event is sent asynchronously.
+     DONE id sent|failed|suppressed|cancelled elapsed_us
+   A message without LF is treated as a take command of the old protocol,
+   and the response is OK, COALESCED, BUSY or FAIL without id.
+   The first line may arrive in pieces, so the message is taken as the old protocol
+   only when no LF arrives within OLD_PROTOCOL_WAIT.
+   cancel cancels only the triggers accepted for the client that no other trigger was merged into.
+
    This example code is in the Public Domain (or CC0 licensed, at your option.)
 
    Unless required by applicable law or agreed to in writing, this
@@ -9,11 +24,18 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
-#include "mdns.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_vfs_eventfd.h"
+#include "esp_camera.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -21,45 +43,355 @@
 #include "lwip/netdb.h"
 
 #include "cmd.h"
-
-extern QueueHandle_t xQueueCmd;
+#include "trigger.h"
+#include "sink.h"
 
 static const char *TAG = "TCP";
 
-esp_err_t start_mdns_service()
+#define MAX_CLIENTS CONFIG_TCP_MAX_CLIENTS
+#define MAX_PENDING 8 // Triggers waiting for completion per client
+#define OLD_PROTOCOL_WAIT (100 * 1000LL) // Time to wait for LF in microseconds
+
+typedef struct {
+	int sock;
+	char addr[16];
+	char rx[256];
+	size_t rx_len;
+	bool framed; // The client uses the line protocol
+	uint32_t pending[MAX_PENDING];
+	bool pending_frame[MAX_PENDING]; // The client waits for the frame
+	bool pending_owner[MAX_PENDING]; // Accepted for this client, not merged into another trigger
+	int pending_count;
+	int64_t old_protocol_at; // Time to take the message without LF as the old protocol. 0 when none
+	int burst_count; // Triggers left in the burst
+	int burst_interval;
+	int64_t burst_next;
+	CMD_t burst_cmd; // Trigger of each picture of the burst
+	CMD_t cmd;
+} CLIENT_t;
+
+typedef struct {
+	int32_t event_id;
+	CAMERA_EVENT_t data;
+} EVENT_t;
+
+typedef struct {
+	camera_fb_t *fb;
+	uint32_t id;
+} FRAME_t;
+
+static CLIENT_t clients[MAX_CLIENTS];
+static QueueHandle_t xQueueEvent;
+static QueueHandle_t xQueueFrame;
+static volatile bool s_running = false; // The server is listening
+static SemaphoreHandle_t xSemaphoreFrame;
+static int s_event_fd = -1;
+
+// Called in the event loop task. The event is passed to the server task through the eventfd.
+static void camera_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-	//initialize mDNS service
-	esp_err_t err = mdns_init();
-	if (err) {
-		ESP_LOGE(TAG, "mdns_init failed: %d", err);
-		return ESP_FAIL;
+	CAMERA_EVENT_t *event = (CAMERA_EVENT_t *)event_data;
+	if (event_id == CAMERA_EVENT_CAPTURED) return;
+	EVENT_t item = { event_id, *event };
+	if (xQueueSend(xQueueEvent, &item, 0) != pdPASS) {
+		ESP_LOGW(TAG, "Event queue full. id=%"PRIu32, event->id);
+		return;
 	}
+	uint64_t signal = 1;
+	write(s_event_fd, &signal, sizeof(signal));
+}
 
-	//set hostname
-	//mdns_hostname_set("my-esp32");
-	ESP_LOGI(TAG, "MDNS Hostname:%s", CONFIG_MDNS_HOSTNAME);
-	err = mdns_hostname_set(CONFIG_MDNS_HOSTNAME);
-	if (err) {
-		ESP_LOGE(TAG, "mdns_hostname_set failed: %d", err);
-		return ESP_FAIL;
-	}
-	//set default instance
-	//mdns_instance_name_set("Jhon's ESP32 Thing");
+static SINK_STATS_t s_sink_stats;
+
+/*
+ * Called in the camera task after the mail is queued.
+ * The frame buffer is sent by the server task, and this function returns when it is sent,
+ * so the camera task can return the frame buffer to the driver.
+ * Returns ESP_ERR_INVALID_STATE when the server is not running.
+ */
+static esp_err_t tcp_frame_deliver(camera_fb_t *fb, uint32_t id)
+{
+	if (s_running == false) return ESP_ERR_INVALID_STATE;
+	FRAME_t frame = { fb, id };
+	xQueueSend(xQueueFrame, &frame, portMAX_DELAY);
+	uint64_t signal = 1;
+	write(s_event_fd, &signal, sizeof(signal));
+	xSemaphoreTake(xSemaphoreFrame, portMAX_DELAY);
 	return ESP_OK;
 }
 
+static int client_send(CLIENT_t *client, const char *text)
+{
+	ESP_LOGI(TAG, "%s < %s", client->addr, text);
+	char line[160];
+	int len = snprintf(line, sizeof(line), "%s%s", text, client->framed ? "\n" : "");
+	int err = send(client->sock, line, len, 0);
+	if (err < 0) {
+		ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+	}
+	return err;
+}
+
+static void client_close(CLIENT_t *client)
+{
+	ESP_LOGI(TAG, "Close socket %s", client->addr);
+	close(client->sock);
+	client->sock = -1;
+}
+
+static bool client_send_frame(CLIENT_t *client, camera_fb_t *fb, uint32_t id)
+{
+	char header[64];
+	int len = sprintf(header, "JPEG %"PRIu32" %d\n", id, fb->len);
+	ESP_LOGI(TAG, "%s < JPEG %"PRIu32" %d %dx%d", client->addr, id, fb->len, fb->width, fb->height);
+	if (send(client->sock, header, len, 0) < 0) return false;
+	// Send from the frame buffer as it is
+	size_t sent = 0;
+	while (sent < fb->len) {
+		int err = send(client->sock, fb->buf + sent, fb->len - sent, 0);
+		if (err < 0) {
+			ESP_LOGE(TAG, "Error occurred during sending frame: errno %d", errno);
+			return false;
+		}
+		sent += err;
+	}
+	return true;
+}
+
+static void client_submit(CLIENT_t *client, CMD_t *cmd)
+{
+	TRIGGER_RESULT result = trigger_submit(cmd);
+	char reply[32];
+	if (client->framed == false) {
+		// OK, COALESCED or BUSY
+		if (result == TRIGGER_ACCEPTED) strcpy(reply, "OK");
+		if (result == TRIGGER_COALESCED) strcpy(reply, "COALESCED");
+		if (result == TRIGGER_DROPPED) strcpy(reply, "BUSY");
+		client_send(client, reply);
+		return;
+	}
+	if (result == TRIGGER_DROPPED) {
+		client_send(client, "BUSY");
+		return;
+	}
+	sprintf(reply, "%s %"PRIu32, (result == TRIGGER_ACCEPTED) ? "OK" : "COALESCED", cmd->id);
+	if (client->pending_count < MAX_PENDING) {
+		client->pending_frame[client->pending_count] = cmd->direct;
+		client->pending_owner[client->pending_count] = (result == TRIGGER_ACCEPTED);
+		client->pending[client->pending_count++] = cmd->id;
+	} else {
+		ESP_LOGW(TAG, "Too many pending triggers. id=%"PRIu32" is not tracked", cmd->id);
+	}
+	client_send(client, reply);
+}
+
+static void client_stats(CLIENT_t *client)
+{
+	char reply[160];
+	for (int i=0; i<SOURCE_MAX; i++) {
+		TRIGGER_STATS_t stats;
+		trigger_stats(i, &stats);
+		int64_t delayAvg = stats.pictures ? stats.delaySum / stats.pictures : 0;
+		snprintf(reply, sizeof(reply), "STATS %s accepted=%"PRIu32" coalesced=%"PRIu32" limited=%"PRIu32" dropped=%"PRIu32" pictures=%"PRIu32" delay=%"PRIi64,
+			trigger_source_name(i), stats.accepted, stats.coalesced, stats.limited, stats.dropped, stats.pictures, delayAvg);
+		client_send(client, reply);
+	}
+	int count = 0;
+	for (int i=0; i<MAX_CLIENTS; i++) {
+		if (clients[i].sock >= 0) count++;
+	}
+	snprintf(reply, sizeof(reply), "STATS clients=%d", count);
+	client_send(client, reply);
+	client_send(client, "END");
+}
+
+static void client_cancel(CLIENT_t *client)
+{
+	int cancelled = client->burst_count;
+	client->burst_count = 0;
+	// The event removes the id from pending.
+	// The trigger merged into another trigger is not cancelled, because the picture is for the other one too.
+	for (int i=0; i<client->pending_count; i++) {
+		if (client->pending_owner[i] == false) continue;
+		if (trigger_cancel(client->pending[i])) cancelled++;
+	}
+	char reply[32];
+	sprintf(reply, "CANCELLED %d", cancelled);
+	client_send(client, reply);
+}
+
+static void client_command(CLIENT_t *client, char *line)
+{
+	ESP_LOGI(TAG, "%s > %s", client->addr, line);
+	char *args = line;
+	char *command = NULL;
+	if (client->framed) {
+		// The old protocol has no command. Any message takes a picture.
+		char *save;
+		command = strtok_r(line, " \t\r", &save);
+		args = strtok_r(NULL, "", &save);
+	}
+	if (command == NULL || strcmp(command, "take") == 0 || strcmp(command, "get") == 0) {
+		cmd_init(&client->cmd, CMD_TAKE, SOURCE_TCP);
+		client->cmd.direct = (command && strcmp(command, "get") == 0);
+		if (args && cmd_parse_params(args, &client->cmd) < 0) {
+			ESP_LOGW(TAG, "Invalid parameter");
+			client_send(client, "FAIL");
+			return;
+		}
+		client_submit(client, &client->cmd);
+	} else if (strcmp(command, "burst") == 0) {
+		int count = 0;
+		int interval = 0;
+		char *save;
+		char *word = (args == NULL) ? NULL : strtok_r(args, " \t\r", &save);
+		if (word) count = atoi(word);
+		char *params = (word == NULL) ? NULL : strtok_r(NULL, "", &save);
+		// The interval is optional and comes before the parameters
+		if (params) {
+			char *end;
+			long value = strtol(params, &end, 10);
+			if (end != params && (*end == 0 || *end == ' ' || *end == '\t' || *end == '\r')) {
+				interval = value;
+				params = end;
+			}
+		}
+		if (count <= 0 || interval < 0) {
+			client_send(client, "FAIL burst N [INTERVAL_MS]");
+			return;
+		}
+		// The burst has its own trigger, so a take during the burst does not change it
+		cmd_init(&client->burst_cmd, CMD_TAKE, SOURCE_TCP);
+		client->burst_cmd.burst = true;
+		if (params && cmd_parse_params(params, &client->burst_cmd) < 0) {
+			ESP_LOGW(TAG, "Invalid parameter");
+			client_send(client, "FAIL");
+			return;
+		}
+		char reply[32];
+		sprintf(reply, "OK burst %d", count);
+		client_send(client, reply);
+		client->burst_count = count;
+		client->burst_interval = interval;
+		client->burst_next = esp_timer_get_time();
+	} else if (strcmp(command, "stats") == 0) {
+		client_stats(client);
+	} else if (strcmp(command, "cancel") == 0) {
+		client_cancel(client);
+	} else {
+		client_send(client, "FAIL unknown command");
+	}
+}
+
+static void client_old_protocol(CLIENT_t *client)
+{
+	client->old_protocol_at = 0;
+	client_command(client, client->rx);
+	client->rx_len = 0;
+}
+
+static bool client_receive(CLIENT_t *client)
+{
+	int len = recv(client->sock, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len - 1, 0);
+	// Error occurred during receiving
+	if (len < 0) {
+		ESP_LOGE(TAG, "recv failed: errno %d", errno);
+		return false;
+	}
+	// Connection closed by client
+	else if (len == 0) {
+		ESP_LOGI(TAG, "Connection closed");
+		return false;
+	}
+	client->rx_len += len;
+	client->rx[client->rx_len] = 0;
+
+	char *line = client->rx;
+	char *lf;
+	while ((lf = strchr(line, '\n')) != NULL) {
+		*lf = 0;
+		client->framed = true;
+		client_command(client, line);
+		line = lf + 1;
+	}
+	client->rx_len = strlen(line);
+	memmove(client->rx, line, client->rx_len + 1);
+
+	if (client->framed) client->old_protocol_at = 0;
+	if (client->rx_len && client->framed == false) {
+		// Message of the old protocol, unless LF follows soon
+		if (client->rx_len == sizeof(client->rx) - 1) {
+			client_old_protocol(client);
+		} else if (client->old_protocol_at == 0) {
+			client->old_protocol_at = esp_timer_get_time() + OLD_PROTOCOL_WAIT;
+		}
+	} else if (client->rx_len == sizeof(client->rx) - 1) {
+		ESP_LOGW(TAG, "Line too long");
+		client->rx_len = 0;
+	}
+	return true;
+}
+
+static void dispatch_frames(void)
+{
+	FRAME_t frame;
+	while (xQueueReceive(xQueueFrame, &frame, 0) == pdPASS) {
+		for (int i=0; i<MAX_CLIENTS; i++) {
+			CLIENT_t *client = &clients[i];
+			if (client->sock < 0) continue;
+			for (int j=0; j<client->pending_count; j++) {
+				if (client->pending[j] != frame.id || client->pending_frame[j] == false) continue;
+				client->pending_frame[j] = false;
+				if (client_send_frame(client, frame.fb, frame.id) == false) client_close(client);
+				break;
+			}
+		}
+		xSemaphoreGive(xSemaphoreFrame);
+	}
+}
+
+static void dispatch_events(void)
+{
+	EVENT_t item;
+	static const char *names[] = {"captured", "sent", "failed", "suppressed", "cancelled"};
+	while (xQueueReceive(xQueueEvent, &item, 0) == pdPASS) {
+		for (int i=0; i<MAX_CLIENTS; i++) {
+			CLIENT_t *client = &clients[i];
+			if (client->sock < 0) continue;
+			for (int j=0; j<client->pending_count; j++) {
+				if (client->pending[j] != item.data.id) continue;
+				char reply[64];
+				sprintf(reply, "DONE %"PRIu32" %s %"PRIi64, item.data.id, names[item.event_id], item.data.elapsed);
+				client_send(client, reply);
+				client->pending_count--;
+				client->pending[j] = client->pending[client->pending_count];
+				client->pending_frame[j] = client->pending_frame[client->pending_count];
+				client->pending_owner[j] = client->pending_owner[client->pending_count];
+				break;
+			}
+		}
+	}
+}
+
 void tcp_server(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start TCP PORT=%d", CONFIG_TCP_PORT);
-	CMD_t cmdBuf;
-	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
 
-	/* Start mDNS */
-	start_mdns_service();
+	/* Completion events */
+	esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+	esp_err_t ret = esp_vfs_eventfd_register(&eventfd_config);
+	// Another module may have registered eventfd
+	if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(ret);
+	s_event_fd = eventfd(0, 0);
+	configASSERT( s_event_fd >= 0 );
+	xQueueEvent = xQueueCreate(8, sizeof(EVENT_t));
+	configASSERT( xQueueEvent );
+	xSemaphoreFrame = xSemaphoreCreateBinary();
+	configASSERT( xSemaphoreFrame );
+	xQueueFrame = xQueueCreate(1, sizeof(FRAME_t));
+	configASSERT( xQueueFrame );
+	ESP_ERROR_CHECK(esp_event_handler_register(CAMERA_EVENT, ESP_EVENT_ANY_ID, camera_event_handler, NULL));
 
-	char rx_buffer[128];
-	char tx_buffer[128];
 	char addr_str[128];
 	int addr_family;
 	int ip_protocol;
@@ -97,71 +429,140 @@ void tcp_server(void *pvParameters)
 	}
 	ESP_LOGI(TAG, "Socket bound, port %d", CONFIG_TCP_PORT);
 
-	err = listen(listen_sock, 1);
+	err = listen(listen_sock, MAX_CLIENTS);
 	if (err != 0) {
 		ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
 		return;
 	}
-	ESP_LOGI(TAG, "Socket listening");
+	ESP_LOGI(TAG, "Socket listening max clients=%d", MAX_CLIENTS);
+	s_running = true;
 
-	while (1) {
-		struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-		//uint addr_len = sizeof(source_addr);
-		socklen_t addr_len = sizeof(source_addr);
-		int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-		if (sock < 0) {
-			ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-			break;
-		}
-		ESP_LOGI(TAG, "Socket accepted");
+	for (int i=0; i<MAX_CLIENTS; i++) clients[i].sock = -1;
 
-		while (1) {
-			int len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-			// Error occurred during receiving
-			if (len < 0) {
-				ESP_LOGE(TAG, "recv failed: errno %d", errno);
-				break;
+	while (1) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(listen_sock, &rfds);
+		FD_SET(s_event_fd, &rfds);
+		int max_fd = (listen_sock > s_event_fd) ? listen_sock : s_event_fd;
+		int64_t now = esp_timer_get_time();
+		int64_t wait = -1;
+		for (int i=0; i<MAX_CLIENTS; i++) {
+			if (clients[i].sock < 0) continue;
+			FD_SET(clients[i].sock, &rfds);
+			if (clients[i].sock > max_fd) max_fd = clients[i].sock;
+			if (clients[i].burst_count) {
+				int64_t remain = clients[i].burst_next - now;
+				if (remain < 0) remain = 0;
+				if (wait < 0 || remain < wait) wait = remain;
 			}
-			// Connection closed by client
-			else if (len == 0) {
-				ESP_LOGI(TAG, "Connection closed");
-				break;
+			if (clients[i].old_protocol_at) {
+				int64_t remain = clients[i].old_protocol_at - now;
+				if (remain < 0) remain = 0;
+				if (wait < 0 || remain < wait) wait = remain;
 			}
+		}
 
-			// Data received
-			// Get the sender's ip address as string
-			if (source_addr.sin6_family == PF_INET) {
-				inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-			} else if (source_addr.sin6_family == PF_INET6) {
-				inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
-			}
+		// Wait until a client sends, an event arrives, the next trigger of burst or the old protocol message
+		struct timeval tv;
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+		int n = select(max_fd + 1, &rfds, NULL, NULL, (wait < 0) ? NULL : &tv);
+		if (n < 0) {
+			ESP_LOGE(TAG, "select failed: errno %d", errno);
+			vTaskDelay(10);
+			continue;
+		}
 
-			rx_buffer[len] = 0; // Null-terminate whatever we received and treat like a string
-			ESP_LOGI(TAG, "Received %d bytes from %s:", len, addr_str);
-			ESP_LOGI(TAG, "%s", rx_buffer);
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
-				strcpy(tx_buffer, "FAIL");
-				int err = send(sock, tx_buffer, strlen(tx_buffer), 0);
-				if (err < 0) {
-					ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-					break;
-				}
+		if (FD_ISSET(s_event_fd, &rfds)) {
+			uint64_t signal;
+			read(s_event_fd, &signal, sizeof(signal));
+			// The frame comes before the event of the mail
+			dispatch_frames();
+			dispatch_events();
+		}
 
+		if (FD_ISSET(listen_sock, &rfds)) {
+			struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+			socklen_t addr_len = sizeof(source_addr);
+			int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+			if (sock < 0) {
+				ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
 			} else {
-				strcpy(tx_buffer, "OK");
-				int err = send(sock, tx_buffer, strlen(tx_buffer), 0);
-				if (err < 0) {
-					ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-					break;
+				CLIENT_t *client = NULL;
+				for (int i=0; i<MAX_CLIENTS; i++) {
+					if (clients[i].sock < 0) {
+						client = &clients[i];
+						break;
+					}
+				}
+				if (client == NULL) {
+					ESP_LOGW(TAG, "Too many clients");
+					close(sock);
+				} else {
+					memset(client, 0, sizeof(CLIENT_t));
+					client->sock = sock;
+					// A stalled client must not hold the frame buffer forever
+					struct timeval timeout = { .tv_sec = CONFIG_TCP_SEND_TIMEOUT, .tv_usec = 0 };
+					setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+					// Get the sender's ip address as string
+					if (source_addr.sin6_family == PF_INET) {
+						inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, client->addr, sizeof(client->addr) - 1);
+					} else if (source_addr.sin6_family == PF_INET6) {
+						inet6_ntoa_r(source_addr.sin6_addr, client->addr, sizeof(client->addr) - 1);
+					}
+					ESP_LOGI(TAG, "Socket accepted %s", client->addr);
 				}
 			}
 		}
 
-		ESP_LOGI(TAG, "Close socket");
-		close(sock);
+		now = esp_timer_get_time();
+		for (int i=0; i<MAX_CLIENTS; i++) {
+			CLIENT_t *client = &clients[i];
+			if (client->sock < 0) continue;
+			if (FD_ISSET(client->sock, &rfds)) {
+				if (client_receive(client) == false) {
+					client_close(client);
+					continue;
+				}
+			}
+			if (client->old_protocol_at && client->old_protocol_at <= now) {
+				client_old_protocol(client);
+			}
+			if (client->burst_count && client->burst_next <= now) {
+				CMD_t cmd = client->burst_cmd;
+				client_submit(client, &cmd);
+				client->burst_count--;
+				client->burst_next = now + client->burst_interval * 1000LL;
+			}
+		}
 	}
 
 	/* Don't reach here. */
 	vTaskDelete(NULL);
 }
+
+// The frame is sent to the client that requested it with get, in the camera task
+static esp_err_t tcp_sink_submit(SINK_FRAME_t *frame)
+{
+	if (frame->direct == false || frame->fb == NULL) {
+		sink_stats_update(&s_sink_stats, ESP_ERR_NOT_SUPPORTED, 0, 0);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	esp_err_t ret = tcp_frame_deliver(frame->fb, frame->info.triggerId);
+	sink_stats_update(&s_sink_stats, ret, frame->fb->len, frame->info.triggerTime);
+	return ret;
+}
+
+static void tcp_sink_stats(SINK_STATS_t *stats)
+{
+	*stats = s_sink_stats;
+}
+
+const SINK_t tcp_sink = {
+	.name = "TCP",
+	.usesFrameBuffer = false, // Held only for get
+	.submit = tcp_sink_submit,
+	.flush = NULL,
+	.stats = tcp_sink_stats,
+};
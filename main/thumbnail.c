@@ -0,0 +1,54 @@
+/* Thumbnail of JPEG picture
+
+	The picture decoded at 1/8 scale, which only uses the DC coefficients,
+	is encoded again as a small JPEG.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+
+#include "preview.h"
+
+static const char *TAG = "THUMBNAIL";
+
+esp_err_t thumbnail_create(const PREVIEW_t *preview, char * FileName, size_t *thumbnailSize)
+{
+	int64_t start = esp_timer_get_time();
+	if (preview->rgb == NULL) return ESP_ERR_INVALID_ARG;
+
+	uint8_t *out = NULL;
+	size_t out_len = 0;
+	bool converted = fmt2jpg(preview->rgb, preview->width * preview->height * 3, preview->width, preview->height,
+		PIXFORMAT_RGB888, CONFIG_THUMBNAIL_QUALITY, &out, &out_len);
+	if (!converted) {
+		ESP_LOGE(TAG, "fmt2jpg fail");
+		return ESP_FAIL;
+	}
+	int64_t encoded = esp_timer_get_time();
+
+	FILE* f = fopen(FileName, "wb");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open file for writing");
+		free(out);
+		return ESP_FAIL;
+	}
+	fwrite(out, out_len, 1, f);
+	fclose(f);
+	free(out);
+	*thumbnailSize = out_len;
+
+	ESP_LOGI(TAG, "thumbnail=%dx%d %d bytes encode=%"PRIi64"us total=%"PRIi64"us",
+		preview->width, preview->height, (int)out_len, encoded - start, esp_timer_get_time() - start);
+	return ESP_OK;
+}
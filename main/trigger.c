@@ -0,0 +1,203 @@
+/* Trigger aggregator
+
+	All shutter sources submit their triggers here instead of sending to the queue.
+	Triggers that arrive within the coalesce window of the last accepted trigger,
+	or while a trigger is still waiting in the queue, are merged into it.
+	The triggers of a burst ask for a picture each, so they are never merged.
+	Each source has a token bucket, so a trigger storm from one source is dropped.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "cmd.h"
+#include "trigger.h"
+
+extern QueueHandle_t xQueueCmd;
+
+static const char *TAG = "TRIGGER";
+
+#define COALESCE_WINDOW ((int64_t)CONFIG_TRIGGER_COALESCE_WINDOW * 1000)
+#define RATE_INTERVAL ((int64_t)CONFIG_TRIGGER_RATE_INTERVAL * 1000)
+#define RATE_BURST CONFIG_TRIGGER_RATE_BURST
+
+typedef struct {
+	int64_t credit; // Tokens in microseconds. One token is RATE_INTERVAL
+	int64_t updated;
+	TRIGGER_STATS_t stats;
+} BUCKET_t;
+
+static SemaphoreHandle_t s_mutex;
+static BUCKET_t s_bucket[SOURCE_MAX];
+static CMD_t s_last;
+static int64_t s_last_time;
+static bool s_last_valid;
+static bool s_last_shared; // Another trigger is merged into the last trigger
+static uint32_t s_next_id = 1;
+
+static const char *source_names[SOURCE_MAX] = {"KEYBOARD", "GPIO", "TCP", "UDP", "MQTT"};
+static const char *result_names[] = {"accepted", "coalesced", "dropped"};
+
+void trigger_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	int64_t now = esp_timer_get_time();
+	for (int i=0; i<SOURCE_MAX; i++) {
+		memset(&s_bucket[i], 0, sizeof(BUCKET_t));
+		s_bucket[i].credit = RATE_INTERVAL * RATE_BURST;
+		s_bucket[i].updated = now;
+	}
+	s_last_valid = false;
+	ESP_LOGI(TAG, "coalesce=%dms rate=1/%dms burst=%d",
+		CONFIG_TRIGGER_COALESCE_WINDOW, CONFIG_TRIGGER_RATE_INTERVAL, RATE_BURST);
+}
+
+static bool bucket_take(BUCKET_t *bucket, int64_t now)
+{
+	if (RATE_INTERVAL == 0) return true;
+	bucket->credit += now - bucket->updated;
+	if (bucket->credit > RATE_INTERVAL * RATE_BURST) bucket->credit = RATE_INTERVAL * RATE_BURST;
+	bucket->updated = now;
+	if (bucket->credit < RATE_INTERVAL) return false;
+	bucket->credit -= RATE_INTERVAL;
+	return true;
+}
+
+static bool same_params(CMD_t *a, CMD_t *b)
+{
+	return a->command == b->command && a->framesize == b->framesize
+		&& a->quality == b->quality && a->flash == b->flash && a->direct == b->direct
+		&& strcmp(a->to, b->to) == 0;
+}
+
+/*
+ * Submit a trigger without blocking the source.
+ * Coalesced triggers are not queued, but the picture taken for the earlier trigger covers them.
+ * The trigger is stamped with the current time, unless the source has stamped it.
+ * cmd->id is set to the id of the trigger, or the id of the trigger it is merged into.
+ * It is 0 when the trigger is dropped.
+ */
+TRIGGER_RESULT trigger_submit(CMD_t *cmd)
+{
+	int64_t now = esp_timer_get_time();
+	SOURCE source = cmd->source;
+	configASSERT( source < SOURCE_MAX );
+	CMD_t trigger = *cmd;
+	if (trigger.timestamp == 0) trigger.timestamp = now;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	BUCKET_t *bucket = &s_bucket[source];
+	TRIGGER_RESULT result;
+	bool pending = uxQueueMessagesWaiting(xQueueCmd) != 0;
+	trigger.id = s_next_id;
+	if (trigger.burst == false && s_last_valid && same_params(&s_last, &trigger) && (pending || now - s_last_time < COALESCE_WINDOW)) {
+		result = TRIGGER_COALESCED;
+		bucket->stats.coalesced++;
+		cmd->id = s_last.id;
+		s_last_shared = true;
+	} else if (bucket_take(bucket, now) == false) {
+		result = TRIGGER_DROPPED;
+		bucket->stats.limited++;
+		cmd->id = 0;
+	} else if (xQueueSend(xQueueCmd, &trigger, 0) != pdPASS) {
+		// Give back the token
+		bucket->credit += RATE_INTERVAL;
+		result = TRIGGER_DROPPED;
+		bucket->stats.dropped++;
+		cmd->id = 0;
+	} else {
+		result = TRIGGER_ACCEPTED;
+		bucket->stats.accepted++;
+		s_last = trigger;
+		s_last_time = now;
+		s_last_valid = true;
+		s_last_shared = false;
+		cmd->id = s_next_id++;
+		if (s_next_id == 0) s_next_id = 1;
+	}
+	TRIGGER_STATS_t stats = bucket->stats;
+	xSemaphoreGive(s_mutex);
+
+	ESP_LOGI(TAG, "%s %s id=%"PRIu32" accepted=%"PRIu32" coalesced=%"PRIu32" limited=%"PRIu32" dropped=%"PRIu32,
+		source_names[source], result_names[result], cmd->id, stats.accepted, stats.coalesced, stats.limited, stats.dropped);
+	return result;
+}
+
+void trigger_stats(SOURCE source, TRIGGER_STATS_t *stats)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	*stats = s_bucket[source].stats;
+	xSemaphoreGive(s_mutex);
+}
+
+// Cancel the trigger if it is still waiting for the camera.
+// The trigger that other triggers are merged into is not cancelled, because they wait for the picture.
+bool trigger_cancel(uint32_t id)
+{
+	bool cancelled = false;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	CMD_t head;
+	if (s_last_valid && s_last.id == id && s_last_shared) {
+		xSemaphoreGive(s_mutex);
+		ESP_LOGI(TAG, "id=%"PRIu32" is shared. Not cancelled", id);
+		return false;
+	}
+	if (id && xQueuePeek(xQueueCmd, &head, 0) == pdPASS && head.id == id) {
+		cancelled = (xQueueReceive(xQueueCmd, &head, 0) == pdPASS);
+	}
+	if (cancelled && s_last_valid && s_last.id == id) s_last_valid = false;
+	xSemaphoreGive(s_mutex);
+	if (cancelled) {
+		ESP_LOGI(TAG, "id=%"PRIu32" cancelled", id);
+		cmd_post_event(CAMERA_EVENT_CANCELLED, head.id, head.source, head.timestamp);
+	}
+	return cancelled;
+}
+
+// Record the picture taken for the trigger
+void trigger_done(CMD_t *cmd)
+{
+	int64_t delay = esp_timer_get_time() - cmd->timestamp;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	TRIGGER_STATS_t *stats = &s_bucket[cmd->source].stats;
+	stats->pictures++;
+	stats->delaySum += delay;
+	if (delay > stats->delayMax) stats->delayMax = delay;
+	xSemaphoreGive(s_mutex);
+	ESP_LOGI(TAG, "%s trigger to picture=%"PRIi64"us", source_names[cmd->source], delay);
+}
+
+// Display the statistics of the sources that have triggered
+void trigger_dump(void)
+{
+	for (int i=0; i<SOURCE_MAX; i++) {
+		TRIGGER_STATS_t stats;
+		trigger_stats(i, &stats);
+		if (stats.accepted + stats.coalesced + stats.limited + stats.dropped == 0) continue;
+		int64_t delayAvg = stats.pictures ? stats.delaySum / stats.pictures : 0;
+		ESP_LOGI(TAG, "%s accepted=%"PRIu32" coalesced=%"PRIu32" limited=%"PRIu32" dropped=%"PRIu32" pictures=%"PRIu32" delay avg=%"PRIi64"us max=%"PRIi64"us",
+			source_names[i], stats.accepted, stats.coalesced, stats.limited, stats.dropped, stats.pictures, delayAvg, stats.delayMax);
+	}
+}
+
+const char *trigger_source_name(SOURCE source)
+{
+	return source_names[source];
+}
+
+const char *trigger_result_name(TRIGGER_RESULT result)
+{
+	return result_names[result];
+}
@@ -0,0 +1,21 @@
+// Result of trigger_submit
+typedef enum {TRIGGER_ACCEPTED, TRIGGER_COALESCED, TRIGGER_DROPPED} TRIGGER_RESULT;
+
+typedef struct {
+	uint32_t accepted;
+	uint32_t coalesced;
+	uint32_t limited; // Dropped by the rate limit
+	uint32_t dropped; // Dropped because the camera is busy
+	uint32_t pictures; // Pictures taken
+	int64_t delaySum; // Time from trigger to picture in microseconds
+	int64_t delayMax;
+} TRIGGER_STATS_t;
+
+void trigger_init(void);
+TRIGGER_RESULT trigger_submit(CMD_t *cmd);
+void trigger_stats(SOURCE source, TRIGGER_STATS_t *stats);
+bool trigger_cancel(uint32_t id);
+void trigger_done(CMD_t *cmd);
+void trigger_dump(void);
+const char *trigger_source_name(SOURCE source);
+const char *trigger_result_name(TRIGGER_RESULT result);
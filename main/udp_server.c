@@ -1,5 +1,19 @@
 /*
-   UDP Broadcast Receiver Example
+   UDP Trigger Receiver
+
+   The trigger datagram is authenticated with HMAC-SHA256 and sequenced.
+     offset size
+     0      2    magic "SC"
+     2      1    version
+     3      1    flags (bit0: ack request, bit7: ack)
+     4      4    sender id (big endian)
+     8      4    sequence number (big endian)
+     12     n    parameters as text like "framesize=VGA quality=10" (may be empty)
+     12+n   16   HMAC-SHA256 of the preceding bytes truncated to 16 bytes
+   The ack datagram has the same header with bit7 of flags set,
+   followed by result(1), reserved(3), trigger id(4) and the HMAC.
+   Datagrams whose sequence number has been received are not triggered, but acked again.
+   The replay window is kept while in deep sleep and in NVS over the power cycle.
 
    This example code is in the Public Domain (or CC0 licensed, at your option.)
 
@@ -12,9 +26,14 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "nvs.h"
+#include "mbedtls/md.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -22,17 +41,292 @@
 #include "lwip/netdb.h"
 
 #include "cmd.h"
-
-extern QueueHandle_t xQueueCmd;
+#include "trigger.h"
+#include "wifi_manager.h"
 
 static const char *TAG = "UDP";
 
+#define UDP_MAGIC0 'S'
+#define UDP_MAGIC1 'C'
+#define UDP_VERSION 1
+#define UDP_FLAG_ACK_REQUEST 0x01
+#define UDP_FLAG_ACK 0x80
+#define UDP_HEADER_SIZE 12
+#define UDP_HMAC_SIZE 16
+#define UDP_PARAMS_SIZE 64
+#define UDP_ACK_SIZE (UDP_HEADER_SIZE + 8 + UDP_HMAC_SIZE)
+
+#define MAX_SENDERS 8 // Senders tracked by the replay window
+#define WINDOW_SIZE 64
+
+#define REPLAY_VERSION 2
+#define NVS_NAMESPACE "udp"
+#define NVS_KEY "reserve"
+#define RESERVE_AHEAD 1024 // Sequence numbers reserved by one write to NVS
+
+// Result in the ack. 0 to 2 are TRIGGER_RESULT
+typedef enum {
+	UDP_RESULT_DUPLICATE = 3, // The sequence number has been received
+	UDP_RESULT_INVALID = 4, // Invalid parameter
+} UDP_RESULT;
+
+typedef struct {
+	uint32_t sender;
+	uint32_t top; // Highest sequence number received
+	uint64_t bitmap; // bit n is set when top - n has been received
+	int64_t used; // For eviction of the least recently used sender
+	bool valid;
+} WINDOW_t;
+
+typedef struct {
+	uint32_t received;
+	uint32_t triggered;
+	uint32_t duplicate;
+	uint32_t unauthenticated;
+	uint32_t malformed;
+} UDP_STATS_t;
+
+typedef struct {
+	uint32_t version;
+	uint32_t floor; // Highest sequence number of the forgotten senders
+	bool floorValid;
+	uint32_t reserve; // Saved in NVS. The accepted sequence numbers are lower than this
+	bool reserveValid;
+	WINDOW_t window[MAX_SENDERS];
+} REPLAY_t;
+
+// Kept while in deep sleep
+RTC_DATA_ATTR static REPLAY_t s_rtc_replay;
+static REPLAY_t s_replay;
+static UDP_STATS_t s_stats;
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void compute_hmac(const uint8_t *data, size_t len, uint8_t *hmac)
+{
+	uint8_t digest[32];
+	const char *key = CONFIG_UDP_SECRET;
+	mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const unsigned char *)key, strlen(key), data, len, digest);
+	memcpy(hmac, digest, UDP_HMAC_SIZE);
+}
+
+static bool verify_hmac(const uint8_t *data, size_t len, const uint8_t *hmac)
+{
+	uint8_t expected[UDP_HMAC_SIZE];
+	compute_hmac(data, len, expected);
+	// Compare in constant time
+	uint8_t diff = 0;
+	for (int i=0; i<UDP_HMAC_SIZE; i++) diff |= expected[i] ^ hmac[i];
+	return diff == 0;
+}
+
+static void load_replay(void)
+{
+	if (s_rtc_replay.version == REPLAY_VERSION) {
+		s_replay = s_rtc_replay;
+	} else {
+		// The windows are lost with the power.
+		// All sequence numbers up to the reserve may have been received, so they become the floor.
+		nvs_handle_t handle;
+		memset(&s_replay, 0, sizeof(s_replay));
+		if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+			if (nvs_get_u32(handle, NVS_KEY, &s_replay.reserve) == ESP_OK) {
+				s_replay.reserveValid = true;
+				s_replay.floor = s_replay.reserve;
+				s_replay.floorValid = true;
+			}
+			nvs_close(handle);
+		}
+		s_replay.version = REPLAY_VERSION;
+	}
+	// The timer starts from zero again
+	for (int i=0; i<MAX_SENDERS; i++) s_replay.window[i].used = 0;
+	ESP_LOGI(TAG, "Replay floor=%"PRIu32" valid=%d", s_replay.floor, s_replay.floorValid);
+}
+
+/*
+ * Called each time the window moves.
+ * The window is kept in RTC memory while in deep sleep.
+ * NVS only keeps a reserve ahead of the highest sequence number,
+ * so NVS is written once for RESERVE_AHEAD sequence numbers instead of each datagram.
+ */
+static void save_replay(uint32_t seq)
+{
+	if (s_replay.reserveValid == false || (int32_t)(seq - s_replay.reserve) >= 0) {
+		uint32_t reserve = seq + RESERVE_AHEAD;
+		nvs_handle_t handle;
+		esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+		if (err == ESP_OK) {
+			err = nvs_set_u32(handle, NVS_KEY, reserve);
+			if (err == ESP_OK) err = nvs_commit(handle);
+			nvs_close(handle);
+		}
+		if (err == ESP_OK) {
+			ESP_LOGI(TAG, "Reserve sequence numbers to %"PRIu32, reserve);
+			s_replay.reserve = reserve;
+			s_replay.reserveValid = true;
+		} else {
+			ESP_LOGW(TAG, "Replay reserve not saved: %s", esp_err_to_name(err));
+		}
+	}
+	s_rtc_replay = s_replay;
+}
+
+/*
+ * Sliding window of the sequence numbers for each sender.
+ * Returns false when the sequence number has been received or is older than the window.
+ * A forgotten sender may come back as an unknown sender,
+ * so an unknown sender must send a sequence number higher than all the forgotten senders.
+ * Call this only for authenticated datagrams.
+ */
+static bool window_accept(uint32_t sender, uint32_t seq)
+{
+	int64_t now = esp_timer_get_time();
+	WINDOW_t *window = NULL;
+	WINDOW_t *unused = NULL;
+	for (int i=0; i<MAX_SENDERS; i++) {
+		if (s_replay.window[i].valid == false) {
+			if (unused == NULL || unused->valid) unused = &s_replay.window[i];
+		} else if (s_replay.window[i].sender == sender) {
+			window = &s_replay.window[i];
+			break;
+		} else if (unused == NULL || (unused->valid && s_replay.window[i].used < unused->used)) {
+			unused = &s_replay.window[i];
+		}
+	}
+	if (window == NULL) {
+		if (s_replay.floorValid && (int32_t)(seq - s_replay.floor) <= 0) return false;
+		// A new sender takes an empty entry or the least recently used entry
+		if (unused->valid) {
+			ESP_LOGW(TAG, "Forget sender %08"PRIx32" top=%"PRIu32, unused->sender, unused->top);
+			if (s_replay.floorValid == false || (int32_t)(unused->top - s_replay.floor) > 0) {
+				s_replay.floor = unused->top;
+				s_replay.floorValid = true;
+			}
+		}
+		window = unused;
+		window->valid = true;
+		window->sender = sender;
+		window->top = seq;
+		window->bitmap = 1;
+		window->used = now;
+		save_replay(seq);
+		return true;
+	}
+	window->used = now;
+	// The difference is signed, so the sequence number may wrap around
+	int32_t diff = (int32_t)(seq - window->top);
+	if (diff > 0) {
+		window->bitmap = (diff >= WINDOW_SIZE) ? 0 : window->bitmap << diff;
+		window->bitmap |= 1;
+		window->top = seq;
+		save_replay(seq);
+		return true;
+	}
+	int offset = -diff;
+	if (offset >= WINDOW_SIZE) return false;
+	if (window->bitmap & (1ULL << offset)) return false;
+	window->bitmap |= (1ULL << offset);
+	save_replay(seq);
+	return true;
+}
+
+static void send_ack(int fd, struct sockaddr_in *to, const uint8_t *request, uint8_t result, uint32_t id)
+{
+	uint8_t ack[UDP_ACK_SIZE];
+	memcpy(ack, request, UDP_HEADER_SIZE);
+	ack[3] = UDP_FLAG_ACK;
+	ack[12] = result;
+	ack[13] = ack[14] = ack[15] = 0;
+	put_be32(&ack[16], id);
+	compute_hmac(ack, UDP_HEADER_SIZE + 8, &ack[UDP_HEADER_SIZE + 8]);
+	int ret = lwip_sendto(fd, ack, sizeof(ack), 0, (struct sockaddr *)to, sizeof(*to));
+	if (ret < 0) {
+		ESP_LOGW(TAG, "lwip_sendto fail errno=%d", errno);
+	}
+}
+
+static void handle_datagram(int fd, uint8_t *buffer, int len, struct sockaddr_in *senderInfo)
+{
+	CMD_t cmdBuf;
+	cmd_init(&cmdBuf, CMD_TAKE, SOURCE_UDP);
+	char params[UDP_PARAMS_SIZE + 1];
+
+	if (len < UDP_HEADER_SIZE + UDP_HMAC_SIZE || buffer[0] != UDP_MAGIC0 || buffer[1] != UDP_MAGIC1) {
+#if CONFIG_UDP_ACCEPT_TEXT
+		// Text datagram of the old protocol
+		if (len > UDP_PARAMS_SIZE) len = UDP_PARAMS_SIZE;
+		memcpy(params, buffer, len);
+		params[len] = 0;
+		ESP_LOGI(TAG, "text=[%s]", params);
+		if (cmd_parse_params(params, &cmdBuf) < 0) {
+			ESP_LOGW(TAG, "Invalid parameter");
+			return;
+		}
+		if (trigger_submit(&cmdBuf) != TRIGGER_DROPPED) s_stats.triggered++;
+#else
+		s_stats.malformed++;
+		ESP_LOGW(TAG, "Not a trigger datagram len=%d", len);
+#endif
+		return;
+	}
+
+	int paramsLen = len - UDP_HEADER_SIZE - UDP_HMAC_SIZE;
+	if (buffer[2] != UDP_VERSION || (buffer[3] & UDP_FLAG_ACK) || paramsLen > UDP_PARAMS_SIZE) {
+		s_stats.malformed++;
+		ESP_LOGW(TAG, "Malformed datagram version=%d flags=0x%x len=%d", buffer[2], buffer[3], len);
+		return;
+	}
+	if (verify_hmac(buffer, len - UDP_HMAC_SIZE, buffer + len - UDP_HMAC_SIZE) == false) {
+		// No response to the datagram that is not authenticated
+		s_stats.unauthenticated++;
+		ESP_LOGW(TAG, "HMAC mismatch. unauthenticated=%"PRIu32, s_stats.unauthenticated);
+		return;
+	}
+
+	uint32_t sender = get_be32(&buffer[4]);
+	uint32_t seq = get_be32(&buffer[8]);
+	bool ackRequest = (buffer[3] & UDP_FLAG_ACK_REQUEST) != 0;
+	if (window_accept(sender, seq) == false) {
+		s_stats.duplicate++;
+		ESP_LOGI(TAG, "sender=%08"PRIx32" seq=%"PRIu32" duplicate=%"PRIu32, sender, seq, s_stats.duplicate);
+		// The ack may have been lost, so ack again
+		if (ackRequest) send_ack(fd, senderInfo, buffer, UDP_RESULT_DUPLICATE, 0);
+		return;
+	}
+
+	memcpy(params, &buffer[UDP_HEADER_SIZE], paramsLen);
+	params[paramsLen] = 0;
+	ESP_LOGI(TAG, "sender=%08"PRIx32" seq=%"PRIu32" params=[%s]", sender, seq, params);
+	if (cmd_parse_params(params, &cmdBuf) < 0) {
+		ESP_LOGW(TAG, "Invalid parameter");
+		if (ackRequest) send_ack(fd, senderInfo, buffer, UDP_RESULT_INVALID, 0);
+		return;
+	}
+	TRIGGER_RESULT result = trigger_submit(&cmdBuf);
+	if (result != TRIGGER_DROPPED) s_stats.triggered++;
+	if (ackRequest) send_ack(fd, senderInfo, buffer, result, cmdBuf.id);
+}
+
 void udp_server(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start UDP PORT=%d", CONFIG_UDP_PORT);
-	CMD_t cmdBuf;
-	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
+	if (strlen(CONFIG_UDP_SECRET) == 0) {
+		ESP_LOGE(TAG, "UDP shared secret is not set. UDP shutter is disabled");
+		vTaskDelete( NULL );
+	}
+	load_replay();
 
 	/* set up address to recvfrom */
 	struct sockaddr_in addr;
@@ -46,44 +340,56 @@ void udp_server(void *pvParameters)
 	int fd;
 	int ret;
 	fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP ); // Create a UDP socket.
-	LWIP_ASSERT("fd >= 0", fd >= 0);
-
-#if 0
-	/* set option */
-	int broadcast=1;
-	ret = lwip_setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof broadcast);
-	LWIP_ASSERT("ret >= 0", ret >= 0);
-#endif
+	if (fd < 0) {
+		ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+		vTaskDelete( NULL );
+	}
 
 	/* bind socket */
 	ret = lwip_bind(fd, (struct sockaddr *)&addr, sizeof(addr));
-	LWIP_ASSERT("ret >= 0", ret >= 0);
+	if (ret < 0) {
+		ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+		lwip_close(fd);
+		vTaskDelete( NULL );
+	}
+
+#if CONFIG_UDP_MULTICAST
+	/* join multicast group after the station has the address */
+	wifi_manager_wait(portMAX_DELAY);
+	struct ip_mreq mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = inet_addr(CONFIG_UDP_MULTICAST_ADDRESS);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	ret = lwip_setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+	if (ret < 0) {
+		ESP_LOGE(TAG, "Unable to join multicast group %s: errno %d", CONFIG_UDP_MULTICAST_ADDRESS, errno);
+	} else {
+		ESP_LOGI(TAG, "Join multicast group %s", CONFIG_UDP_MULTICAST_ADDRESS);
+	}
+#endif
 
 	/* senderInfo data */
-	char buffer[64];
+	uint8_t buffer[UDP_HEADER_SIZE + UDP_PARAMS_SIZE + UDP_HMAC_SIZE];
 	struct sockaddr_in senderInfo;
-	socklen_t senderInfoLen = sizeof(senderInfo);
+	socklen_t senderInfoLen;
 	char senderstr[16];
 	while(1) {
-		memset(buffer, 0, sizeof(buffer));
-		//ESP_LOGI(TAG, "senderInfoLen=%d", senderInfoLen);
+		senderInfoLen = sizeof(senderInfo);
 		ret = lwip_recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&senderInfo, &senderInfoLen);
-		LWIP_ASSERT("ret > 0", ret > 0);
-		ESP_LOGI(TAG, "lwip_recv ret=%d",ret);
-		if (ret > 0) {
-			buffer[ret] = 0;
-			ESP_LOGI(TAG, "lwip_recv buffer=%s",buffer);
-			inet_ntop(AF_INET, &senderInfo.sin_addr, senderstr, sizeof(senderstr));
-			ESP_LOGI(TAG, "recvfrom : %s, port=%d", senderstr, ntohs(senderInfo.sin_port));
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
-			}
-
+		if (ret < 0) {
+			ESP_LOGE(TAG, "lwip_recvfrom fail errno=%d", errno);
+			vTaskDelay(10);
+			continue;
 		}
+		s_stats.received++;
+		inet_ntop(AF_INET, &senderInfo.sin_addr, senderstr, sizeof(senderstr));
+		ESP_LOGI(TAG, "recvfrom : %s, port=%d len=%d", senderstr, ntohs(senderInfo.sin_port), ret);
+		handle_datagram(fd, buffer, ret, &senderInfo);
+		ESP_LOGI(TAG, "received=%"PRIu32" triggered=%"PRIu32" duplicate=%"PRIu32" unauthenticated=%"PRIu32" malformed=%"PRIu32,
+			s_stats.received, s_stats.triggered, s_stats.duplicate, s_stats.unauthenticated, s_stats.malformed);
 	}
 
 	/* close socket. Don't reach here. */
-	ret = lwip_close(fd);
-	LWIP_ASSERT("ret == 0", ret == 0);
+	lwip_close(fd);
 	vTaskDelete( NULL );
 }
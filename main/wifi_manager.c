@@ -0,0 +1,318 @@
+/* WiFi station that never gives up
+
+	The station reconnects with exponential backoff for ever.
+	The tasks that use the network wait for the connection with wifi_manager_wait().
+
+	The BSSID and the channel of the last AP are kept in NVS.
+	A cold boot connects to that AP on that channel without the full scan.
+	When the AP is not found there, the cache is dropped and all channels are scanned.
+	The last IP address is requested again from the DHCP server by LWIP_DHCP_RESTORE_LAST_IP.
+	A copy of the cache is kept in RTC memory, so a wake from deep sleep does not read NVS.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "lwip/dns.h"
+
+#include "wifi_manager.h"
+
+static const char *TAG = "WIFI";
+
+/* FreeRTOS event group to signal when we are connected*/
+static EventGroupHandle_t s_wifi_event_group;
+#define WIFI_CONNECTED_BIT BIT0
+
+#define NVS_NAMESPACE "wifi"
+#define NVS_KEY "fast"
+#define CACHE_VERSION 1
+
+// Fast connect parameters
+typedef struct {
+	uint32_t version;
+	char ssid[33];
+	uint8_t bssid[6];
+	uint8_t channel;
+} CACHE_t;
+
+typedef struct {
+	int64_t started; // esp_wifi_start was called
+	int64_t disconnected; // Start of the current outage
+	int64_t firstConnect; // From start to the first IP
+	int64_t outageMax;
+	uint32_t connects;
+	uint32_t disconnects;
+	uint32_t fastConnects;
+	uint32_t fastFallbacks;
+	uint8_t lastReason;
+} STATS_t;
+
+static STATS_t s_stats;
+static CACHE_t s_cache;
+RTC_DATA_ATTR static CACHE_t s_rtc_cache;
+static bool s_fast = false; // Connecting with the cached BSSID and channel
+static int s_attempt = 0;
+static esp_timer_handle_t s_retry_timer;
+
+static void load_cache(void)
+{
+	// Kept while in deep sleep
+	if (s_rtc_cache.version == CACHE_VERSION && strcmp(s_rtc_cache.ssid, CONFIG_ESP_WIFI_SSID) == 0) {
+		s_cache = s_rtc_cache;
+		return;
+	}
+	nvs_handle_t handle;
+	memset(&s_cache, 0, sizeof(s_cache));
+	if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return;
+	size_t len = sizeof(s_cache);
+	esp_err_t err = nvs_get_blob(handle, NVS_KEY, &s_cache, &len);
+	nvs_close(handle);
+	if (err != ESP_OK || len != sizeof(s_cache) || s_cache.version != CACHE_VERSION
+		|| strcmp(s_cache.ssid, CONFIG_ESP_WIFI_SSID) != 0) {
+		memset(&s_cache, 0, sizeof(s_cache));
+	}
+	s_rtc_cache = s_cache;
+}
+
+static void save_cache(const uint8_t *bssid, uint8_t channel)
+{
+	// Do not wear the flash when nothing has changed
+	if (s_cache.version == CACHE_VERSION && s_cache.channel == channel && memcmp(s_cache.bssid, bssid, 6) == 0) return;
+	s_cache.version = CACHE_VERSION;
+	strlcpy(s_cache.ssid, CONFIG_ESP_WIFI_SSID, sizeof(s_cache.ssid));
+	memcpy(s_cache.bssid, bssid, 6);
+	s_cache.channel = channel;
+	s_rtc_cache = s_cache;
+
+	nvs_handle_t handle;
+	esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+	if (err == ESP_OK) {
+		err = nvs_set_blob(handle, NVS_KEY, &s_cache, sizeof(s_cache));
+		if (err == ESP_OK) err = nvs_commit(handle);
+		nvs_close(handle);
+	}
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG, "Fast connect cache not saved: %s", esp_err_to_name(err));
+		return;
+	}
+	ESP_LOGI(TAG, "Fast connect cache saved. bssid="MACSTR" channel=%d", MAC2STR(bssid), channel);
+}
+
+static void set_config(bool fast)
+{
+	wifi_config_t wifi_config = {
+		.sta = {
+			.ssid = CONFIG_ESP_WIFI_SSID,
+			.password = CONFIG_ESP_WIFI_PASSWORD,
+			.scan_method = WIFI_FAST_SCAN,
+		},
+	};
+	if (fast) {
+		wifi_config.sta.bssid_set = true;
+		memcpy(wifi_config.sta.bssid, s_cache.bssid, 6);
+		wifi_config.sta.channel = s_cache.channel;
+		ESP_LOGI(TAG, "Fast connect to bssid="MACSTR" channel=%d", MAC2STR(s_cache.bssid), s_cache.channel);
+	} else {
+		// All channels are scanned and the AP with the best signal is used
+		wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+		wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+	}
+	s_fast = fast;
+	ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+}
+
+static void retry_timer_callback(void *arg)
+{
+	esp_wifi_connect();
+}
+
+// The delay doubles from WIFI_BACKOFF_MIN to WIFI_BACKOFF_MAX, and a random quarter is added
+// so that the cameras do not reconnect at the same moment after the AP restarts.
+static uint32_t backoff_delay(void)
+{
+	uint32_t delay = CONFIG_WIFI_BACKOFF_MAX;
+	if (s_attempt < 16 && ((uint32_t)CONFIG_WIFI_BACKOFF_MIN << s_attempt) < CONFIG_WIFI_BACKOFF_MAX) {
+		delay = (uint32_t)CONFIG_WIFI_BACKOFF_MIN << s_attempt;
+	}
+	s_attempt++;
+	return delay + esp_random() % (delay / 4 + 1);
+}
+
+static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+	if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+		esp_wifi_connect();
+	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+		wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+		ESP_LOGI(TAG, "connected to ap bssid="MACSTR" channel=%d", MAC2STR(event->bssid), event->channel);
+		save_cache(event->bssid, event->channel);
+	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+		wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+		s_stats.lastReason = event->reason;
+		if (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT) {
+			xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+			s_stats.disconnected = esp_timer_get_time();
+			s_stats.disconnects++;
+		}
+		if (s_fast) {
+			// The AP may have moved to another channel, or the BSSID is not in range
+			ESP_LOGW(TAG, "Fast connect failed reason=%d. Scan all channels", event->reason);
+			s_stats.fastFallbacks++;
+			set_config(false);
+			esp_wifi_connect();
+			return;
+		}
+		uint32_t delay = backoff_delay();
+		ESP_LOGW(TAG, "connect to the AP fail reason=%d. retry in %"PRIu32"ms", event->reason, delay);
+		esp_timer_stop(s_retry_timer);
+		esp_timer_start_once(s_retry_timer, (uint64_t)delay * 1000);
+	} else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+		ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+		int64_t now = esp_timer_get_time();
+		if (s_stats.connects == 0) {
+			s_stats.firstConnect = now - s_stats.started;
+			ESP_LOGI(TAG, "got ip:" IPSTR " in %"PRIi64"ms%s", IP2STR(&event->ip_info.ip),
+				s_stats.firstConnect / 1000, s_fast ? " (fast connect)" : "");
+		} else {
+			int64_t outage = now - s_stats.disconnected;
+			if (outage > s_stats.outageMax) s_stats.outageMax = outage;
+			ESP_LOGI(TAG, "got ip:" IPSTR " after %"PRIi64"ms offline", IP2STR(&event->ip_info.ip), outage / 1000);
+		}
+		if (s_fast) s_stats.fastConnects++;
+		s_stats.connects++;
+		s_attempt = 0;
+		xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+	}
+}
+
+#if CONFIG_STATIC_IP
+static esp_err_t example_set_dns_server(esp_netif_t *netif, uint32_t addr, esp_netif_dns_type_t type)
+{
+	if (addr && (addr != IPADDR_NONE)) {
+		esp_netif_dns_info_t dns;
+		dns.ip.u_addr.ip4.addr = addr;
+		dns.ip.type = IPADDR_TYPE_V4;
+		ESP_ERROR_CHECK(esp_netif_set_dns_info(netif, type, &dns));
+	}
+	return ESP_OK;
+}
+#endif
+
+/*
+ * Start the station and return without waiting for the connection.
+ * The default event loop must be created before.
+ */
+esp_err_t wifi_manager_start(void)
+{
+	ESP_ERROR_CHECK(esp_netif_init());
+	esp_netif_t *netif = esp_netif_create_default_wifi_sta();
+	assert(netif);
+
+#if CONFIG_STATIC_IP
+
+	ESP_LOGI(TAG, "CONFIG_STATIC_IP_ADDRESS=[%s]",CONFIG_STATIC_IP_ADDRESS);
+	ESP_LOGI(TAG, "CONFIG_STATIC_GW_ADDRESS=[%s]",CONFIG_STATIC_GW_ADDRESS);
+	ESP_LOGI(TAG, "CONFIG_STATIC_NM_ADDRESS=[%s]",CONFIG_STATIC_NM_ADDRESS);
+
+	/* Stop DHCP client */
+	ESP_ERROR_CHECK(esp_netif_dhcpc_stop(netif));
+	ESP_LOGI(TAG, "Stop DHCP Services");
+
+	/* Set STATIC IP Address */
+	esp_netif_ip_info_t ip_info;
+	memset(&ip_info, 0 , sizeof(esp_netif_ip_info_t));
+	ip_info.ip.addr = ipaddr_addr(CONFIG_STATIC_IP_ADDRESS);
+	ip_info.netmask.addr = ipaddr_addr(CONFIG_STATIC_NM_ADDRESS);
+	ip_info.gw.addr = ipaddr_addr(CONFIG_STATIC_GW_ADDRESS);;
+	ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
+
+	/* Set DNS Server */
+	ESP_ERROR_CHECK(example_set_dns_server(netif, ipaddr_addr("8.8.8.8"), ESP_NETIF_DNS_MAIN));
+	ESP_ERROR_CHECK(example_set_dns_server(netif, ipaddr_addr("8.8.4.4"), ESP_NETIF_DNS_BACKUP));
+
+#endif // CONFIG_STATIC_IP
+
+	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+	ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+	// The configuration is given each time, so the driver does not need to keep it in flash
+	ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+	const esp_timer_create_args_t timer_args = {
+		.callback = retry_timer_callback,
+		.name = "wifi_retry",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
+
+	ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+		ESP_EVENT_ANY_ID,
+		&event_handler,
+		NULL,
+		NULL));
+	ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+		IP_EVENT_STA_GOT_IP,
+		&event_handler,
+		NULL,
+		NULL));
+
+	load_cache();
+#if CONFIG_DEEP_SLEEP
+	// The radio sleeps between the beacons while the picture is sent
+	ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+#else
+	ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+#endif
+	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+#if CONFIG_WIFI_FAST_CONNECT
+	set_config(s_cache.version == CACHE_VERSION);
+#else
+	set_config(false);
+#endif
+	s_stats.started = esp_timer_get_time();
+	ESP_ERROR_CHECK(esp_wifi_start());
+	ESP_LOGI(TAG, "Connecting to SSID:%s", CONFIG_ESP_WIFI_SSID);
+	return ESP_OK;
+}
+
+// Called before any task waits for the connection
+void wifi_manager_init(void)
+{
+	s_wifi_event_group = xEventGroupCreate();
+	configASSERT( s_wifi_event_group );
+}
+
+// Wait until the station has the IP address
+bool wifi_manager_wait(TickType_t xTicksToWait)
+{
+	EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, xTicksToWait);
+	return (bits & WIFI_CONNECTED_BIT) != 0;
+}
+
+bool wifi_manager_connected(void)
+{
+	return wifi_manager_wait(0);
+}
+
+void wifi_manager_dump(void)
+{
+	ESP_LOGI(TAG, "connects=%"PRIu32" disconnects=%"PRIu32" fast=%"PRIu32" fallback=%"PRIu32" first=%"PRIi64"ms outageMax=%"PRIi64"ms lastReason=%d",
+		s_stats.connects, s_stats.disconnects, s_stats.fastConnects, s_stats.fastFallbacks,
+		s_stats.firstConnect / 1000, s_stats.outageMax / 1000, s_stats.lastReason);
+}
@@ -0,0 +1,5 @@
+void wifi_manager_init(void);
+esp_err_t wifi_manager_start(void);
+bool wifi_manager_wait(TickType_t xTicksToWait);
+bool wifi_manager_connected(void);
+void wifi_manager_dump(void);
@@ -0,0 +1,64 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+#
+# Receive the picture published by the MQTT image sink
+#
+# Requirement library
+# python3 -m pip install -U paho-mqtt
+#
+import argparse
+import json
+import time
+import zlib
+import paho.mqtt.client as mqtt
+
+# Chunks of each picture keyed by camera/trigger
+pictures = {}
+
+def on_connect(client, userdata, flags, rc, properties=None):
+	print("connected rc={}".format(rc))
+	client.subscribe(userdata['topic'] + "/#", qos=1)
+
+def on_message(client, userdata, msg):
+	words = msg.topic[len(userdata['topic']) + 1:].split('/')
+	if (len(words) < 3): return
+	key = "{}/{}".format(words[0], words[1])
+	picture = pictures.setdefault(key, {'chunks':{}, 'start':time.time()})
+	if (words[2] == 'chunk'):
+		picture['chunks'][int(words[3])] = msg.payload
+		return
+	if (words[2] != 'manifest'): return
+	manifest = json.loads(msg.payload)
+	del pictures[key]
+	if (len(picture['chunks']) != manifest['chunks']):
+		print("{} {} of {} chunks received".format(key, len(picture['chunks']), manifest['chunks']))
+		return
+	jpeg = b''.join(picture['chunks'][i] for i in range(manifest['chunks']))
+	crc = zlib.crc32(jpeg) & 0xffffffff
+	status = "ok" if (len(jpeg) == manifest['size'] and crc == manifest['crc32']) else "corrupted"
+	elapsed = time.time() - picture['start']
+	fileName = "{}-{}.jpg".format(words[0], words[1])
+	with open(fileName, 'wb') as f:
+		f.write(jpeg)
+	print("{} {} bytes {}x{} {} chunks in {:.1f}ms {} -> {}".format(key, len(jpeg), manifest['width'], manifest['height'],
+		manifest['chunks'], elapsed * 1000, status, fileName))
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--host', help='mqtt broker', default="broker.emqx.io")
+	parser.add_argument('--port', type=int, help='mqtt port', default=1883)
+	parser.add_argument('--topic', help='image topic', default="/camera/image")
+	args = parser.parse_args()
+	print("args.host={}".format(args.host))
+	print("args.topic={}".format(args.topic))
+
+	userdata = {'topic':args.topic}
+	try:
+		client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, userdata=userdata)
+	except AttributeError:
+		# paho-mqtt 1.x
+		client = mqtt.Client(userdata=userdata)
+	client.on_connect = on_connect
+	client.on_message = on_message
+	client.connect(args.host, args.port, 60)
+	client.loop_forever()
@@ -0,0 +1,119 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+# Concurrency benchmark of the TCP control server
+# Each client sends take commands and waits for the DONE events.
+# With --burst, each client sends one burst command, and the camera submits the triggers at the interval.
+import argparse
+import socket
+import threading
+import time
+
+def percentile(values, p):
+	if (len(values) == 0): return 0.0
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def client_thread(args, results, lock):
+	client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	client.settimeout(args.timeout)
+	client.connect((args.host, args.port))
+	reader = client.makefile('r', encoding='utf-8')
+	message = 'take {}\n'.format(args.params).encode('utf-8')
+	acks = []
+	dones = []
+	counts = {}
+	waiting = {}
+	if (args.burst):
+		message = 'burst {} {} {}\n'.format(args.count, int(args.interval * 1000), args.params).encode('utf-8')
+		client.send(message)
+		line = reader.readline().strip()
+		if (line.startswith('OK') == False):
+			print("burst failed: {}".format(line))
+			client.close()
+			return
+		# One response for each trigger of the burst. The delivery time is counted from the response
+		received = 0
+		while (received < args.count):
+			line = reader.readline().strip()
+			if (line == ''): break
+			words = line.split()
+			if (words[0] == 'DONE'):
+				counts[words[2]] = counts.get(words[2], 0) + 1
+				if (words[1] in waiting): dones.append(time.time() - waiting.pop(words[1]))
+				continue
+			received += 1
+			counts[words[0]] = counts.get(words[0], 0) + 1
+			if (len(words) > 1 and words[1] not in waiting): waiting[words[1]] = time.time()
+	for i in range(0 if args.burst else args.count):
+		start = time.time()
+		client.send(message)
+		# Events of earlier triggers may arrive before the response
+		while True:
+			line = reader.readline().strip()
+			if (line == ''): break
+			words = line.split()
+			if (words[0] == 'DONE'):
+				counts[words[2]] = counts.get(words[2], 0) + 1
+				if (words[1] in waiting): dones.append(time.time() - waiting.pop(words[1]))
+				continue
+			acks.append(time.time() - start)
+			counts[words[0]] = counts.get(words[0], 0) + 1
+			# A coalesced trigger has the id of the earlier trigger
+			if (len(words) > 1 and words[1] not in waiting): waiting[words[1]] = start
+			break
+		if (args.interval > 0): time.sleep(args.interval)
+
+	# Wait for the remaining events
+	deadline = time.time() + args.timeout
+	while (len(waiting) and time.time() < deadline):
+		try:
+			line = reader.readline().strip()
+		except socket.timeout:
+			break
+		words = line.split()
+		if (len(words) < 3 or words[0] != 'DONE'): continue
+		counts[words[2]] = counts.get(words[2], 0) + 1
+		if (words[1] in waiting): dones.append(time.time() - waiting.pop(words[1]))
+	client.close()
+	with lock:
+		results['acks'].extend(acks)
+		results['dones'].extend(dones)
+		results['lost'] += len(waiting)
+		for key in counts:
+			results['counts'][key] = results['counts'].get(key, 0) + counts[key]
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--host', help='tcp host', default="esp32-camera.local")
+	parser.add_argument('--port', type=int, help='tcp port', default=49876)
+	parser.add_argument('--clients', type=int, help='number of clients', default=4)
+	parser.add_argument('--count', type=int, help='number of triggers for each client', default=10)
+	parser.add_argument('--interval', type=float, help='interval of triggers in seconds', default=0.5)
+	parser.add_argument('--params', help='capture parameters', default="")
+	parser.add_argument('--timeout', type=float, help='time to wait for events in seconds', default=60.0)
+	parser.add_argument('--burst', action='store_true', help='send one burst command of count triggers at interval')
+	args = parser.parse_args()
+	print("args.host={}".format(args.host))
+	print("args.port={}".format(args.port))
+
+	results = {'acks':[], 'dones':[], 'lost':0, 'counts':{}}
+	lock = threading.Lock()
+	threads = []
+	start = time.time()
+	for i in range(args.clients):
+		thread = threading.Thread(target=client_thread, args=(args, results, lock))
+		thread.start()
+		threads.append(thread)
+	for thread in threads:
+		thread.join()
+	elapsed = time.time() - start
+
+	total = args.clients * args.count
+	print("{} clients x {} triggers in {:.2f} sec ({:.1f} triggers/sec)".format(args.clients, args.count, elapsed, total / elapsed))
+	acks = results['acks']
+	dones = results['dones']
+	print("response p50={:.1f}ms p99={:.1f}ms max={:.1f}ms".format(percentile(acks, 50) * 1000, percentile(acks, 99) * 1000, max(acks, default=0) * 1000))
+	print("delivery p50={:.1f}ms p99={:.1f}ms max={:.1f}ms".format(percentile(dones, 50) * 1000, percentile(dones, 99) * 1000, max(dones, default=0) * 1000))
+	print("no event={}".format(results['lost']))
+	for key in sorted(results['counts']):
+		print("{}={}".format(key, results['counts'][key]))
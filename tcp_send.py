@@ -2,20 +2,80 @@
 #-*- encoding: utf-8 -*-
 import argparse
 import socket
+import time
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def get_picture(reader, message, client):
+	# get returns OK id, then JPEG id len and the picture
+	start = time.time()
+	ack = 0
+	client.send(message)
+	# DONE events of the earlier pictures may arrive
+	while True:
+		words = reader.readline().decode('utf-8').split()
+		if (len(words) == 0): return None, 0, 0
+		if (words[0] in ('BUSY', 'FAIL')): return words[0], 0, 0
+		if (words[0] == 'JPEG'): break
+		if (words[0] in ('OK', 'COALESCED')): ack = time.time() - start
+	length = int(words[2])
+	jpeg = reader.read(length)
+	return jpeg, ack, time.time() - start
 
 if __name__=='__main__':
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--host', help='tcp host', default="esp32-camera.local")
 	parser.add_argument('--port', type=int, help='tcp port', default=49876)
+	parser.add_argument('--count', type=int, help='number of triggers for load test', default=1)
+	parser.add_argument('--interval', type=float, help='interval of triggers in seconds', default=0.0)
+	parser.add_argument('--params', help='capture parameters', default="")
+	parser.add_argument('--get', action='store_true', help='receive the picture on the socket')
+	parser.add_argument('--output', help='file name of the received picture', default="picture.jpg")
 	args = parser.parse_args()
 	print("args.host={}".format(args.host))
 	print("args.port={}".format(args.port))
 
 	client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
 	client.connect((args.host, args.port))
-	client.send(b'take picture')
-	response = client.recv(1024)
+	results = {}
+	start = time.time()
+	if (args.get):
+		message = 'get {}\n'.format(args.params).encode('utf-8')
+		reader = client.makefile('rb')
+		acks = []
+		latencies = []
+		for i in range(args.count):
+			jpeg, ack, latency = get_picture(reader, message, client)
+			if (type(jpeg) is not bytes):
+				results[str(jpeg)] = results.get(str(jpeg), 0) + 1
+			else:
+				results['JPEG'] = results.get('JPEG', 0) + 1
+				acks.append(ack)
+				latencies.append(latency)
+				with open(args.output, 'wb') as f:
+					f.write(jpeg)
+				print("{} bytes response={:.1f}ms round trip={:.1f}ms".format(len(jpeg), ack * 1000, latency * 1000))
+			if (args.interval > 0): time.sleep(args.interval)
+		if (len(latencies)):
+			print("round trip p50={:.1f}ms p99={:.1f}ms min={:.1f}ms max={:.1f}ms".format(percentile(latencies, 50) * 1000,
+				percentile(latencies, 99) * 1000, min(latencies) * 1000, max(latencies) * 1000))
+			print("last picture is {}".format(args.output))
+	else:
+		message = 'take picture {}'.format(args.params).strip().encode('utf-8')
+		for i in range(args.count):
+			client.send(message)
+			response = client.recv(1024)
+			if (type(response) is bytes):
+				response=response.decode('utf-8')
+			if (args.count == 1): print(response)
+			results[response] = results.get(response, 0) + 1
+			if (args.interval > 0): time.sleep(args.interval)
+	elapsed = time.time() - start
 	client.close()
-	if (type(response) is bytes):
-		response=response.decode('utf-8')
-	print(response)
+	if (args.count > 1):
+		# OK:accepted COALESCED:merged into the last trigger BUSY:dropped FAIL:invalid parameter
+		print("{} triggers in {:.2f} sec ({:.1f} triggers/sec)".format(args.count, elapsed, args.count / elapsed))
+		for key in sorted(results):
+			print("{}={}".format(key, results[key]))
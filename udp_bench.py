@@ -0,0 +1,128 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+# Packet rate benchmark of the UDP trigger protocol
+# Datagrams are sent at the given rate with ack request, and the acks are counted.
+# A part of the datagrams is sent twice to check the replay window.
+# --loopback runs a receiver on this host that works like the ESP32.
+import argparse
+import random
+import socket
+import threading
+import time
+import udp_protocol
+
+def percentile(values, p):
+	if (len(values) == 0): return 0.0
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def loopback_receiver(sock, secret, stop):
+	# Sliding window of 64 sequence numbers for each sender
+	windows = {}
+	while (stop.is_set() == False):
+		try:
+			datagram, sender_addr = sock.recvfrom(1024)
+		except socket.timeout:
+			continue
+		data, mac = datagram[:-udp_protocol.HMAC_SIZE], datagram[-udp_protocol.HMAC_SIZE:]
+		if (udp_protocol.sign(secret, data) != mac): continue
+		sender = int.from_bytes(data[4:8], 'big')
+		seq = int.from_bytes(data[8:12], 'big')
+		top, bitmap = windows.get(sender, (seq, 0))
+		diff = (seq - top) & 0xffffffff
+		if (diff & 0x80000000): diff -= 0x100000000
+		if (sender not in windows or diff > 0):
+			bitmap = ((bitmap << diff) & 0xffffffffffffffff if diff < 64 else 0) | 1
+			top, result = seq, 0
+		elif (-diff < 64 and (bitmap >> -diff) & 1 == 0):
+			bitmap |= 1 << -diff
+			result = 0
+		else:
+			result = 3
+		windows[sender] = (top, bitmap)
+		ack = udp_protocol.MAGIC + bytes([udp_protocol.VERSION, udp_protocol.FLAG_ACK]) + data[4:12] + bytes([result, 0, 0, 0]) + (0).to_bytes(4, 'big')
+		sock.sendto(ack + udp_protocol.sign(secret, ack), sender_addr)
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--host', help='udp host', default="esp32-camera.local")
+	parser.add_argument('--port', type=int, help='udp port', default=49876)
+	parser.add_argument('--count', type=int, help='number of datagrams', default=1000)
+	parser.add_argument('--rate', type=float, help='datagrams per second. 0 is unlimited', default=100.0)
+	parser.add_argument('--duplicate', type=float, help='ratio of datagrams sent twice', default=0.1)
+	parser.add_argument('--params', help='capture parameters', default="")
+	parser.add_argument('--secret', help='shared secret. Same as UDP shared secret of ESP32', default="")
+	parser.add_argument('--timeout', type=float, help='time to wait for the last acks in seconds', default=1.0)
+	parser.add_argument('--loopback', action='store_true', help='run the receiver on this host')
+	args = parser.parse_args()
+	if (args.loopback == False and args.secret == ""): parser.error("--secret is required")
+
+	secret = args.secret.encode('utf-8')
+	params = args.params.encode('utf-8')
+	sender = random.getrandbits(32)
+	stop = threading.Event()
+	host = args.host
+	if (args.loopback):
+		host = '127.0.0.1'
+		receiver = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		receiver.bind((host, args.port))
+		receiver.settimeout(0.1)
+		thread = threading.Thread(target=loopback_receiver, args=(receiver, secret, stop))
+		thread.start()
+	address = (socket.gethostbyname(host), args.port)
+	print("address={}".format(address))
+
+	# Cost of signing on this host
+	start = time.time()
+	for i in range(10000):
+		udp_protocol.trigger(secret, sender, i, params, True)
+	print("sign {:.0f} datagrams/sec".format(10000 / (time.time() - start)))
+
+	client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	client.bind(('', 0))
+	client.settimeout(0.1)
+	sent = {}
+	rtts = []
+	counts = {}
+	def ack_receiver():
+		while (stop.is_set() == False):
+			try:
+				response, camera = client.recvfrom(1024)
+			except socket.timeout:
+				continue
+			ack = udp_protocol.parse_ack(secret, response)
+			if (ack is None or ack[0] != sender): continue
+			result = udp_protocol.RESULTS.get(ack[2], str(ack[2]))
+			counts[result] = counts.get(result, 0) + 1
+			if (ack[1] in sent): rtts.append(time.time() - sent.pop(ack[1]))
+	ack_thread = threading.Thread(target=ack_receiver)
+	ack_thread.start()
+
+	seq = udp_protocol.first_sequence()
+	duplicates = 0
+	start = time.time()
+	for i in range(args.count):
+		datagram = udp_protocol.trigger(secret, sender, seq, params, True)
+		sent[seq] = time.time()
+		client.sendto(datagram, address)
+		if (random.random() < args.duplicate):
+			client.sendto(datagram, address)
+			duplicates += 1
+		seq = (seq + 1) & 0xffffffff
+		if (args.rate > 0):
+			delay = start + (i + 1) / args.rate - time.time()
+			if (delay > 0): time.sleep(delay)
+	elapsed = time.time() - start
+	time.sleep(args.timeout)
+	stop.set()
+	ack_thread.join()
+	if (args.loopback): thread.join()
+	client.close()
+
+	total = args.count + duplicates
+	acked = sum(counts.values())
+	print("sent {} datagrams ({} duplicates) in {:.2f} sec ({:.1f} datagrams/sec)".format(total, duplicates, elapsed, total / elapsed))
+	print("acked {} ({:.1f}%) lost {}".format(acked, acked * 100 / total, len(sent)))
+	print("ack rtt p50={:.2f}ms p99={:.2f}ms max={:.2f}ms".format(percentile(rtts, 50) * 1000, percentile(rtts, 99) * 1000, max(rtts, default=0) * 1000))
+	for key in sorted(counts):
+		print("{}={}".format(key, counts[key]))
@@ -0,0 +1,35 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+# Trigger datagram of the UDP shutter
+# magic(2) version(1) flags(1) sender(4) seq(4) params(n) hmac(16)
+import hashlib
+import hmac
+import struct
+import time
+
+MAGIC = b'SC'
+VERSION = 1
+FLAG_ACK_REQUEST = 0x01
+FLAG_ACK = 0x80
+HMAC_SIZE = 16
+RESULTS = {0:'accepted', 1:'coalesced', 2:'dropped', 3:'duplicate', 4:'invalid'}
+
+def sign(secret, data):
+	return hmac.new(secret, data, hashlib.sha256).digest()[:HMAC_SIZE]
+
+def first_sequence():
+	# The sequence number increases over restarts of the sender
+	return int(time.time() * 1000) & 0xffffffff
+
+def trigger(secret, sender, seq, params=b'', ack=False):
+	flags = FLAG_ACK_REQUEST if ack else 0
+	data = MAGIC + struct.pack('>BBII', VERSION, flags, sender, seq & 0xffffffff) + params
+	return data + sign(secret, data)
+
+def parse_ack(secret, datagram):
+	# Returns (sender, seq, result, id), or None when it is not a valid ack
+	if (len(datagram) != 12 + 8 + HMAC_SIZE or datagram[0:2] != MAGIC): return None
+	if (hmac.compare_digest(sign(secret, datagram[:-HMAC_SIZE]), datagram[-HMAC_SIZE:]) == False): return None
+	version, flags, sender, seq, result, id = struct.unpack('>BBIIB3xI', datagram[2:-HMAC_SIZE])
+	if (version != VERSION or (flags & FLAG_ACK) == 0): return None
+	return sender, seq, result, id
@@ -5,8 +5,11 @@
 # python3 -m pip install -U netifaces
 #
 import argparse
+import random
 import socket
+import time
 import netifaces
+import udp_protocol
 
 # Get IP address
 for iface_name in netifaces.interfaces():
@@ -21,20 +24,73 @@ for iface_name in netifaces.interfaces():
 
 if __name__=='__main__':
 	parser = argparse.ArgumentParser()
-	parser.add_argument('--port', type=int, help='tcp port', default=49876)
+	parser.add_argument('--port', type=int, help='udp port', default=49876)
+	parser.add_argument('--count', type=int, help='number of triggers for load test', default=1)
+	parser.add_argument('--interval', type=float, help='interval of triggers in seconds', default=0.0)
+	parser.add_argument('--params', help='capture parameters', default="")
+	parser.add_argument('--secret', help='shared secret. Same as UDP shared secret of ESP32', default="")
+	parser.add_argument('--sender', type=lambda x: int(x, 0), help='sender id', default=random.getrandbits(32))
+	parser.add_argument('--multicast', help='multicast address like 239.255.0.1')
+	parser.add_argument('--ack', action='store_true', help='request ack and retransmit until acked')
+	parser.add_argument('--retry', type=int, help='number of retransmissions', default=3)
+	parser.add_argument('--timeout', type=float, help='time to wait for ack in seconds', default=0.5)
+	parser.add_argument('--text', action='store_true', help='send text datagram of the old protocol')
 	args = parser.parse_args()
+	if (args.text == False and args.secret == ""): parser.error("--secret is required")
 	print("args.port={}".format(args.port))
 
 	print("myIp={}".format(myIp))
 	myIpList = myIp.split('.')
 	print("myIpList={}".format(myIpList))
 
-	#address = "192.168.10.255" # for Broadcast
-	address = "{}.{}.{}.255".format(myIpList[0], myIpList[1], myIpList[2])
+	if (args.multicast):
+		address = args.multicast
+	else:
+		#address = "192.168.10.255" # for Broadcast
+		address = "{}.{}.{}.255".format(myIpList[0], myIpList[1], myIpList[2])
 	print("address={}".format(address))
+	print("sender=0x{:08x}".format(args.sender))
 
 	client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
 	client.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
-	client.bind(('', args.port))
-	client.sendto(b'take picture', (address, args.port))
+	client.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+	client.bind(('', 0))
+	client.settimeout(args.timeout)
+	secret = args.secret.encode('utf-8')
+	params = args.params.encode('utf-8')
+	seq = udp_protocol.first_sequence()
+	results = {}
+	start = time.time()
+	for i in range(args.count):
+		if (args.text):
+			client.sendto(b'take picture ' + params, (address, args.port))
+		else:
+			datagram = udp_protocol.trigger(secret, args.sender, seq, params, args.ack)
+			# The retransmission has the same sequence number, so the camera takes only one picture
+			for retry in range(args.retry + 1 if args.ack else 1):
+				sent = time.time()
+				client.sendto(datagram, (address, args.port))
+				if (args.ack == False): break
+				acked = False
+				# Every camera in the group responds
+				try:
+					while True:
+						response, camera = client.recvfrom(1024)
+						ack = udp_protocol.parse_ack(secret, response)
+						if (ack is None or ack[0] != args.sender or ack[1] != seq): continue
+						acked = True
+						result = udp_protocol.RESULTS.get(ack[2], str(ack[2]))
+						results[result] = results.get(result, 0) + 1
+						print("{} seq={} {} id={} rtt={:.1f}ms retry={}".format(camera[0], seq, result, ack[3], (time.time() - sent) * 1000, retry))
+				except socket.timeout:
+					pass
+				if (acked): break
+			seq = (seq + 1) & 0xffffffff
+		if (args.interval > 0): time.sleep(args.interval)
+	elapsed = time.time() - start
 	client.close()
+	if (args.count > 1):
+		# Without --ack, the result of each trigger is displayed in the log of ESP32.
+		print("{} triggers in {:.2f} sec ({:.1f} triggers/sec)".format(args.count, elapsed, args.count / elapsed))
+	for key in sorted(results):
+		print("{}={}".format(key, results[key]))